@@ -0,0 +1,231 @@
+#include "../utility/utility.h"
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <string_view>
+#include <span>
+#include <vector>
+
+
+class AhoCorasick
+{
+    /*
+        Finds every occurrence of any of a set of patterns in a text in one pass, in O(n_T + number of matches) time.
+
+        The patterns are stored in a trie, whose nodes are the prefixes of the patterns.
+        The failure link of a node is KMP's border generalised to the trie: the node of the longest proper suffix of the node's string that is also a prefix of some pattern.
+        It's computed the same way too, in breadth first order, by following the failure links of the parent until a node with the next letter as a child is found.
+        Searching follows trie edges while the text matches and failure links on mismatch, exactly as KMP's i_P = border[i_P].
+
+        A node ends every pattern that's a suffix of its string, which are the patterns ending at the node and at the nodes on its failure chain.
+        The dictionary link of a node skips to the next node on the failure chain that ends a pattern, so reporting the matches at a position costs O(matches).
+
+        Transitions are stored in one of two layouts:
+            Dense: a row of n_alphabet next nodes, already resolved through the failure links, so one lookup per letter and no failure links followed.
+                   Used for the nodes within n_denseDepth of the root (which nearly every step of a search visits) and nodes with at least n_denseChildren children.
+            Sparse: the node's children's letters, stored contiguously and searched linearly, falling back to the failure link.
+                    Used for the (many, mostly unvisited) deep nodes, each costing only a few bytes per child.
+        Nodes are numbered in breadth first order, so the hot nodes near the root are together in memory.
+    */
+
+    static const n_t
+        n_alphabet{256},
+        n_denseDepth{2},
+        n_denseChildren{16};
+
+    static const index_t none{index_t(-1)};
+
+    struct Node
+    {
+        index_t i_fail;
+        index_t i_dictionary; // none if no node on the failure chain ends a pattern
+        index_t i_dense;      // Index of the node's row in denseTransitions, none if sparse
+        index_t i_children;   // Index of the node's first child in labels / children
+        n_t n_children;
+        index_t i_outputs;    // Index of the node's first pattern in outputs
+        n_t n_outputs;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<unsigned char> labels;
+    std::vector<index_t> children;
+    std::vector<index_t> denseTransitions;
+    std::vector<index_t> outputs;
+    std::vector<n_t> patternLengths;
+
+
+    index_t transition(index_t i_node, unsigned char c) const
+    {
+        for (;;)
+        {
+            const Node& node(nodes[i_node]);
+            if (node.i_dense != none)
+                return denseTransitions[node.i_dense * n_alphabet + c];
+
+            for (index_t i(node.i_children); i < node.i_children + node.n_children; ++i)
+                if (labels[i] == c)
+                    return children[i];
+
+            // The root is dense, so this terminates
+            i_node = node.i_fail;
+        }
+    }
+
+public:
+    struct Match
+    {
+        index_t i_pattern;
+        index_t i_T; // Position of the start of the match in the text
+    };
+
+    AhoCorasick(std::span<const std::string_view> patterns)
+        : patternLengths(std::size(patterns))
+    {
+        // Build the trie with unordered children
+        struct TrieNode
+        {
+            std::vector<KV<unsigned char, index_t>> children;
+            std::vector<index_t> patterns;
+        };
+
+        std::vector<TrieNode> trie(1);
+        for (index_t i_pattern{}; i_pattern < std::size(patterns); ++i_pattern)
+        {
+            const std::string_view pattern(patterns[i_pattern]);
+            if (pattern.empty())
+                throw std::domain_error("AhoCorasick::AhoCorasick: empty pattern");
+
+            patternLengths[i_pattern] = std::size(pattern);
+
+            index_t i_node{};
+            for (const char c : pattern)
+            {
+                const auto it(std::find_if(std::cbegin(trie[i_node].children), std::cend(trie[i_node].children), [&](const KV<unsigned char, index_t>& child){ return child.k == (unsigned char)c; }));
+                if (it != std::cend(trie[i_node].children))
+                    i_node = it->v;
+                else
+                {
+                    trie[i_node].children.push_back({(unsigned char)c, std::size(trie)});
+                    i_node = std::size(trie);
+                    trie.emplace_back();
+                }
+            }
+
+            trie[i_node].patterns.push_back(i_pattern);
+        }
+
+        // Number the nodes in breadth first order, and lay out their children and outputs in that order
+        std::vector<index_t> order(1), depths(1);
+        std::vector<index_t> newIndices(std::size(trie));
+        for (index_t i{}; i < std::size(order); ++i)
+        {
+            TrieNode& trieNode(trie[order[i]]);
+            std::sort(std::begin(trieNode.children), std::end(trieNode.children), [](const KV<unsigned char, index_t>& lhs, const KV<unsigned char, index_t>& rhs){ return lhs.k < rhs.k; });
+            for (const KV<unsigned char, index_t>& child : trieNode.children)
+            {
+                newIndices[child.v] = std::size(order);
+                order.push_back(child.v);
+                depths.push_back(depths[i] + 1);
+            }
+        }
+
+        nodes.resize(std::size(trie));
+        for (index_t i{}; i < std::size(order); ++i)
+        {
+            const TrieNode& trieNode(trie[order[i]]);
+            Node& node(nodes[i]);
+
+            node.i_children = std::size(labels);
+            node.n_children = std::size(trieNode.children);
+            for (const KV<unsigned char, index_t>& child : trieNode.children)
+            {
+                labels.push_back(child.k);
+                children.push_back(newIndices[child.v]);
+            }
+
+            node.i_outputs = std::size(outputs);
+            node.n_outputs = std::size(trieNode.patterns);
+            outputs.insert(std::end(outputs), std::cbegin(trieNode.patterns), std::cend(trieNode.patterns));
+
+            node.i_dense = none;
+            if (depths[i] < n_denseDepth || node.n_children >= n_denseChildren)
+            {
+                node.i_dense = std::size(denseTransitions) / n_alphabet;
+                denseTransitions.resize(std::size(denseTransitions) + n_alphabet);
+            }
+        }
+
+        trie.clear();
+
+        // Compute failure links, dictionary links and dense rows in breadth first order
+        // A node's failure link is shallower than it, so it and its whole failure chain are done before the node
+        nodes[0].i_fail = 0;
+        nodes[0].i_dictionary = none;
+        for (index_t i_node{}; i_node < std::size(nodes); ++i_node)
+        {
+            const Node& node(nodes[i_node]);
+
+            if (node.i_dense != none)
+            {
+                index_t* const row(&denseTransitions[node.i_dense * n_alphabet]);
+                for (index_t c{}; c < n_alphabet; ++c)
+                    row[c] = i_node == 0 ? 0 : transition(node.i_fail, (unsigned char)c);
+
+                for (index_t i(node.i_children); i < node.i_children + node.n_children; ++i)
+                    row[labels[i]] = children[i];
+            }
+
+            for (index_t i(node.i_children); i < node.i_children + node.n_children; ++i)
+            {
+                Node& child(nodes[children[i]]);
+                child.i_fail = i_node == 0 ? 0 : transition(node.i_fail, labels[i]);
+
+                const Node& fail(nodes[child.i_fail]);
+                child.i_dictionary = fail.n_outputs ? child.i_fail : fail.i_dictionary;
+            }
+        }
+    }
+
+    n_t size() const
+    {
+        return std::size(patternLengths);
+    }
+
+    // Calls f(Match) for every occurrence of every pattern, in order of the end of the match (then of pattern length, longest first)
+    template<typename F>
+    void search(const char T[], n_t n_T, F&& f) const
+    {
+        for (index_t i_T{}, i_node{}; i_T < n_T; ++i_T)
+        {
+            i_node = transition(i_node, (unsigned char)T[i_T]);
+
+            for (index_t i_output(nodes[i_node].n_outputs ? i_node : nodes[i_node].i_dictionary); i_output != none; i_output = nodes[i_output].i_dictionary)
+            {
+                const Node& output(nodes[i_output]);
+                for (index_t i(output.i_outputs); i < output.i_outputs + output.n_outputs; ++i)
+                    f(Match{outputs[i], i_T + 1 - patternLengths[outputs[i]]});
+            }
+        }
+    }
+
+    std::deque<Match> getMatches(const char T[], n_t n_T) const
+    {
+        std::deque<Match> matches;
+        search(T, n_T, [&](const Match& match){ matches.push_back(match); });
+        return matches;
+    }
+};
+
+#if 0
+int main()
+{
+    const std::string_view patterns[]{"he", "she", "his", "hers"};
+    const AhoCorasick ac(patterns);
+
+    const char T[]{"ushers"};
+    const std::deque<AhoCorasick::Match> matches(ac.getMatches(T, std::size(T) - 1));
+
+    // she at 1, he at 2, hers at 2
+    return std::size(matches) == 3;
+}
+#endif
@@ -0,0 +1,263 @@
+#include "../utility/utility.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if !defined(__GNUC__) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+
+template<typename T>
+class BinaryFuseFilter
+{
+    /*
+        A binary fuse filter is a static probabilistic membership querying data structure (Graf and Lemire, 2022), built once from a fixed set of keys.
+        Lookup may falsely return positive with probability 2^-8 (0.4%), and takes about 9 bits per key (a bloom filter needs 1.44 log2(256) = 11.5).
+
+        The filter is an array of 8-bit fingerprints. Each key maps to three cells (arity 3), and the array is constructed such that
+        the xor of a key's three cells is the fingerprint of the key. Lookup is three memory accesses and a comparison.
+
+        The array is split into segments of a power of two number of cells. A key's three cells are in three consecutive segments,
+        the first chosen uniformly, and each cell uniformly within its segment.
+        Compared to an xor filter (three cells anywhere in three thirds of the array), the locality lets construction succeed with an array of only about
+        1.125 n cells for large n rather than 1.23 n.
+
+        Construction is by peeling: a cell that only one key maps to can be assigned last, as its value can be chosen to satisfy that key whatever the key's other cells are.
+        So repeatedly remove such a key (pushing it onto a stack), which may leave other cells with only one key.
+        If every key is removed, pop the stack, setting each key's free cell to the xor of its fingerprint and its other two cells.
+        Otherwise (with small probability) try again with a different seed. Each attempt is linear time.
+
+        Keys are hashed with std::hash and duplicate hashes are removed, so duplicate keys are allowed.
+        The batch lookup hashes n_batch keys and prefetches all of their cells before testing them, so the cache misses overlap.
+    */
+
+    using Fingerprint = std::uint8_t;
+
+    static const n_t
+        n_arity{3},
+        n_maxSegmentLength{1 << 18},
+        n_batch{16};
+
+    std::uint64_t seed{};
+    n_t n_keys{};
+    n_t segmentLength{};
+    n_t segmentCountLength{}; // Number of cells the first of a key's cells can be in
+    std::vector<Fingerprint> fingerprints;
+
+
+    static std::uint64_t hash(std::uint64_t k_hash, std::uint64_t seed)
+    {
+        // splitmix64 finaliser of the seeded key hash
+        std::uint64_t h(k_hash ^ seed);
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    // High 64 bits of the 128 bit product
+    static std::uint64_t mulhi(std::uint64_t a, std::uint64_t b)
+    {
+#if defined(__SIZEOF_INT128__)
+        return std::uint64_t((unsigned __int128)a * b >> 64);
+#elif defined(_M_X64)
+        return __umulh(a, b);
+#else
+        const std::uint64_t
+            a_low(a & 0xFFFFFFFF), a_high(a >> 32),
+            b_low(b & 0xFFFFFFFF), b_high(b >> 32),
+            middle(a_high * b_low + (a_low * b_low >> 32)),
+            middle2(a_low * b_high + (middle & 0xFFFFFFFF));
+
+        return a_high * b_high + (middle >> 32) + (middle2 >> 32);
+#endif
+    }
+
+    static Fingerprint fingerprint(std::uint64_t h)
+    {
+        return Fingerprint(h ^ h >> 32);
+    }
+
+    // The first cell picks the segment with the high bits of the hash, the other two cells' offsets within their segments come from the low bits
+    void cells(std::uint64_t h, index_t (&i_cells)[n_arity]) const
+    {
+        i_cells[0] = mulhi(h, segmentCountLength);
+        i_cells[1] = i_cells[0] + segmentLength ^ (h >> 18 & segmentLength - 1);
+        i_cells[2] = i_cells[0] + 2 * segmentLength ^ (h & segmentLength - 1);
+    }
+
+    bool test(std::uint64_t h) const
+    {
+        index_t i_cells[n_arity];
+        cells(h, i_cells);
+        return (fingerprints[i_cells[0]] ^ fingerprints[i_cells[1]] ^ fingerprints[i_cells[2]]) == fingerprint(h);
+    }
+
+    static void prefetch(const Fingerprint& cell)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(&cell);
+#elif defined(_M_X64) || defined(_M_IX86)
+        _mm_prefetch(reinterpret_cast<const char*>(&cell), _MM_HINT_T0);
+#endif
+    }
+
+    // Returns false if peeling got stuck
+    bool construct(const std::vector<std::uint64_t>& k_hashes)
+    {
+        const n_t n_cells(std::size(fingerprints));
+
+        // For each cell, the number of keys mapping to it and the xor of their hashes. When the count is 1, the xor is the hash of the only key
+        std::vector<std::uint32_t> counts(n_cells);
+        std::vector<std::uint64_t> xorHashes(n_cells);
+        for (const std::uint64_t k_hash : k_hashes)
+        {
+            const std::uint64_t h(hash(k_hash, seed));
+            index_t i_cells[n_arity];
+            cells(h, i_cells);
+            for (const index_t i_cell : i_cells)
+            {
+                ++counts[i_cell];
+                xorHashes[i_cell] ^= h;
+            }
+        }
+
+        std::vector<index_t> queue;
+        for (index_t i_cell{}; i_cell < n_cells; ++i_cell)
+            if (counts[i_cell] == 1)
+                queue.push_back(i_cell);
+
+        // Peeled keys' hashes and the cells they were peeled from, in peeling order
+        std::vector<KV<std::uint64_t, index_t>> stack;
+        stack.reserve(std::size(k_hashes));
+        while (!queue.empty())
+        {
+            const index_t i_cell(queue.back());
+            queue.pop_back();
+            if (counts[i_cell] != 1)
+                continue;
+
+            const std::uint64_t h(xorHashes[i_cell]);
+            stack.push_back({h, i_cell});
+
+            index_t i_cells[n_arity];
+            cells(h, i_cells);
+            for (const index_t i : i_cells)
+            {
+                xorHashes[i] ^= h;
+                if (--counts[i] == 1)
+                    queue.push_back(i);
+            }
+        }
+
+        if (std::size(stack) != std::size(k_hashes))
+            return false;
+
+        std::fill(std::begin(fingerprints), std::end(fingerprints), 0);
+        for (index_t i(std::size(stack)); i --> 0;)
+        {
+            index_t i_cells[n_arity];
+            cells(stack[i].k, i_cells);
+
+            // The cell being assigned is still zero
+            fingerprints[stack[i].v] = fingerprint(stack[i].k) ^ fingerprints[i_cells[0]] ^ fingerprints[i_cells[1]] ^ fingerprints[i_cells[2]];
+        }
+
+        return true;
+    }
+
+public:
+    BinaryFuseFilter(const T keys[], n_t n, std::uint64_t seed = 0)
+    {
+        std::vector<std::uint64_t> k_hashes(n);
+        for (index_t i{}; i < n; ++i)
+            k_hashes[i] = std::hash<T>{}(keys[i]);
+
+        std::sort(std::begin(k_hashes), std::end(k_hashes));
+        k_hashes.erase(std::unique(std::begin(k_hashes), std::end(k_hashes)), std::end(k_hashes));
+        n_keys = std::size(k_hashes);
+
+        // Segment length and array size factor as recommended by Graf and Lemire for arity 3
+        segmentLength = n_keys ? n_t(1) << int(std::floor(std::log(double(n_keys)) / std::log(3.33) + 2.25)) : 4;
+        segmentLength = std::min(segmentLength, n_maxSegmentLength);
+
+        const double sizeFactor(n_keys <= 1 ? 0 : std::max(1.125, 0.875 + 0.25 * std::log(1e6) / std::log(double(n_keys))));
+        const n_t
+            capacity(n_t(std::round(double(n_keys) * sizeFactor))),
+            n_segmentsMin((capacity + segmentLength - 1) / segmentLength),
+            n_segments(n_segmentsMin > n_arity - 1 ? n_segmentsMin - (n_arity - 1) : 1);
+
+        segmentCountLength = n_segments * segmentLength;
+        fingerprints.resize((n_segments + n_arity - 1) * segmentLength);
+
+        // The i'th attempt uses the seed hash(i, seed)
+        for (std::uint64_t attempt{};; ++attempt)
+        {
+            this->seed = hash(attempt, seed);
+            if (construct(k_hashes))
+                break;
+        }
+    }
+
+    // Number of distinct keys
+    n_t size() const
+    {
+        return n_keys;
+    }
+
+    // Size of the table in bits
+    n_t bitSize() const
+    {
+        return std::size(fingerprints) * bitSize_v<Fingerprint>;
+    }
+
+    bool lookup(const T& v) const
+    {
+        return test(hash(std::hash<T>{}(v), seed));
+    }
+
+    // results[i] = lookup(vs[i])
+    void lookup_batch(std::span<const T> vs, std::span<bool> results) const
+    {
+        std::uint64_t hashes[n_batch];
+        for (index_t i_begin{}; i_begin < std::size(vs); i_begin += n_batch)
+        {
+            const n_t n(std::min(n_batch, std::size(vs) - i_begin));
+            for (index_t i{}; i < n; ++i)
+            {
+                hashes[i] = hash(std::hash<T>{}(vs[i_begin + i]), seed);
+
+                index_t i_cells[n_arity];
+                cells(hashes[i], i_cells);
+                for (const index_t i_cell : i_cells)
+                    prefetch(fingerprints[i_cell]);
+            }
+
+            for (index_t i{}; i < n; ++i)
+                results[i_begin + i] = test(hashes[i]);
+        }
+    }
+};
+
+#if 0
+int main()
+{
+    Array<int> keys(1000000);
+    for (int i{}; i < 1000000; ++i)
+        keys[i] = i;
+
+    const BinaryFuseFilter<int> f(std::begin(keys), std::size(keys));
+
+    n_t falsePositives{};
+    for (int i(1000000); i < 2000000; ++i)
+        falsePositives += f.lookup(i);
+
+    return f.lookup(123) && falsePositives < 10000;
+}
+#endif
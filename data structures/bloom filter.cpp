@@ -1,9 +1,24 @@
 #include "../utility/utility.h"
+#include "../utility/mapped file.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <fstream>
+#include <functional>
 #include <random>
-#include <ratio>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#endif
 
 
-template<typename T, n_t estimatedNumberOfInsertions = 10, typename maxFalsePositiveProbability = std::ratio<5, 100>>
+template<typename T>
 class BloomFilter
 {
     /*
@@ -20,7 +35,7 @@ class BloomFilter
             m = size of hash table
             n = number of insertions
             t = number of `true`s set in the hash table
-        
+
         The probability of a hash function returning a false positive is t / m.
         t is upper bounded by kn (where every insertion writes `true` for every hash function)
         So the probability is upper bounded by kn / m.
@@ -28,68 +43,379 @@ class BloomFilter
 
         The value of k that minimises (kn / m)^k is m / (n e).
         This gives a false positive probability upper bound of (e'^e')^(m / n) ~= 0.692^(m / n), where e' = 1 / e.
-        
+
         Thus given the predicted number of insertions n and a required false positive probability upper bound p, the table size m is lower bounded by:
             m >= n log(p) / log(e'^e') = e n ln(1/p)
+
+        This implementation is blocked (a split block bloom filter):
+        the table is an array of 512 bit blocks (one cache line each), and a key's k = 8 locations are all in one block, one in each of the block's 64-bit words.
+        So insertion and lookup touch exactly one cache line, and the 8 bit masks are computed together with SIMD (when available).
+        Blocking makes the false positive probability somewhat worse than for an unblocked filter of the same size, as some blocks receive more keys than others,
+        but the m above (with k fixed at 8 rather than m / (n e)) still meets p for the usual range of 0.1% to 5%.
+
+        For large filters, almost every insertion and lookup is a cache miss, and a lone lookup spends most of its time waiting on that miss.
+        The batch functions hash n_batch keys, prefetch all of their blocks, then insert or test them, so the cache misses overlap.
+
+        add_concurrent and add_batch_concurrent set bits with atomic ors, so any number of threads may insert into the same filter at once.
+        Lookups mustn't run concurrently with insertions though.
+
+        Filters constructed with the same size and seed hash keys identically, so can be combined word by word:
+        the union (|=) of two filters is the filter of the union of their key sets, and the intersection (&=) contains (at least) the intersection of their key sets.
+        So filters of the partitions of a key set can be built independently (in parallel) and merged.
+
+        save writes the filter to a file (a header padded to one block, then the blocks), which the path constructor memory maps read only.
+        A mapped filter can be looked up in (and merged into an owned filter), but not added to.
+        std::hash<T> must give the same hashes in every process using the file.
     */
 
     static const n_t
-        //n_data{n_t(estimatedNumberOfInsertions * std::log(double(maxFalsePositiveProbability::den) / maxFalsePositiveProbability::num) * 2.718)}, // Would ideally do this, if log could be constexpr'ified
-        n_data{256},
-        n_hashes{n_t(n_data / 2.718 / estimatedNumberOfInsertions)};
+        n_wordsPerBlock{8},
+        n_hashes{n_wordsPerBlock}, // One location per word
+        n_batch{16};
+
+    struct alignas(64) Block
+    {
+        std::uint64_t words[n_wordsPerBlock];
+    };
 
-    unsigned a[n_hashes], b[n_hashes];
-    bool data[n_data]{};
+    static constexpr std::uint64_t
+        magic{0x544C464D4F4F4C42}, // "BLOOMFLT"
+        version{2},
+        byteOrder{0x0102030405060708};
 
+    // Padded to a whole block, so the blocks of a mapped file are aligned
+    // The filter is in the writer's byte order, recorded as byteOrder (read back as a different value on a host of another byte order)
+    struct alignas(64) Header
+    {
+        std::uint64_t
+            magic,
+            version,
+            byteOrder,
+            seed,
+            n_blocks,
+            n_wordsPerBlock;
+    };
 
-    static unsigned uniform_random_int()
+    // Odd constants for multiplicative hashing, one per word of a block
+    alignas(32) static constexpr std::uint32_t salts[n_hashes]
     {
-        static std::default_random_engine UPRNG(std::random_device{}());
-        static std::uniform_int_distribution<unsigned> UID;
+        0x47B6137B, 0x44974D91, 0x8824AD5B, 0xA2B7289D,
+        0x705495C7, 0x2DF1424B, 0x9EFC4947, 0x5C6BFB31
+    };
+
+    std::uint64_t seed;
+    n_t n_blocks;
+
+    // Either owned or mapped
+    Array<Block> data;
+    MappedFile mappedImage;
+    const Block* blocks;
+
+
+    static std::uint64_t uniform_random_int()
+    {
+        static std::mt19937_64 UPRNG(std::random_device{}());
+        static std::uniform_int_distribution<std::uint64_t> UID;
 
         return UID(UPRNG);
     }
 
-    index_t hash(index_t i, index_t k_hash) const
+    std::uint64_t hash(const T& v) const
     {
-        return (k_hash * a[i] + b[i]) % n_data;
+        // splitmix64 finaliser of the seeded std::hash
+        std::uint64_t h(std::hash<T>{}(v) ^ seed);
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
     }
 
-public:
-    BloomFilter()
+    // The high 32 bits of the hash pick the block (by multiplying into [0, n_blocks) rather than taking a modulo)
+    index_t blockIndex(std::uint64_t v_hash) const
+    {
+        return index_t((v_hash >> 32) * n_blocks >> 32);
+    }
+
+#if defined(__AVX2__)
+    // The low 32 bits of the hash pick one bit in each word of the block: the top 6 bits of (hash * salt)
+    static void blockMask(std::uint64_t v_hash, __m256i& mask_low, __m256i& mask_high)
+    {
+        const __m256i shifts(_mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(int(std::uint32_t(v_hash))), _mm256_load_si256(reinterpret_cast<const __m256i*>(salts))), 26));
+        const __m256i ones(_mm256_set1_epi64x(1));
+
+        mask_low = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts)));
+        mask_high = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1)));
+    }
+
+    static void blockMask(std::uint64_t v_hash, std::uint64_t (&mask)[n_wordsPerBlock])
     {
-        for (unsigned& v : a)
-            v = uniform_random_int();
+        __m256i mask_low, mask_high;
+        blockMask(v_hash, mask_low, mask_high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&mask[0]), mask_low);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&mask[4]), mask_high);
+    }
+#else
+    // The low 32 bits of the hash pick one bit in each word of the block: the top 6 bits of (hash * salt)
+    static void blockMask(std::uint64_t v_hash, std::uint64_t (&mask)[n_wordsPerBlock])
+    {
+        for (index_t i{}; i < n_wordsPerBlock; ++i)
+            mask[i] = std::uint64_t(1) << (std::uint32_t(v_hash) * salts[i] >> 26);
+    }
+#endif
 
-        for (unsigned& v : b)
-            v = uniform_random_int();
+    static void prefetch(const Block& block)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(&block);
+#elif defined(_M_X64) || defined(_M_IX86)
+        _mm_prefetch(reinterpret_cast<const char*>(&block), _MM_HINT_T0);
+#endif
     }
 
-    template<typename TT>
-    void add(TT&& v)
+    template<bool atomic>
+    void insert(std::uint64_t v_hash)
     {
-        const index_t v_hash(std::hash<T>(std::forward<TT>(v))());
+        Block& block(data[blockIndex(v_hash)]);
+
+        if constexpr (atomic)
+        {
+            std::uint64_t mask[n_wordsPerBlock];
+            blockMask(v_hash, mask);
 
-        for (index_t i{}; i < n_hashes; ++i)
-            data[hash(i, v_hash)] = true;
+            // Skip the read-modify-write (and the exclusive cache line ownership it needs) for bits that are already set
+            for (index_t i{}; i < n_wordsPerBlock; ++i)
+            {
+                std::atomic_ref word(block.words[i]);
+                if ((word.load(std::memory_order_relaxed) & mask[i]) != mask[i])
+                    word.fetch_or(mask[i], std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+#if defined(__AVX2__)
+            __m256i mask_low, mask_high;
+            blockMask(v_hash, mask_low, mask_high);
+
+            __m256i* const words(reinterpret_cast<__m256i*>(block.words));
+            _mm256_store_si256(&words[0], _mm256_or_si256(_mm256_load_si256(&words[0]), mask_low));
+            _mm256_store_si256(&words[1], _mm256_or_si256(_mm256_load_si256(&words[1]), mask_high));
+#else
+            std::uint64_t mask[n_wordsPerBlock];
+            blockMask(v_hash, mask);
+
+            for (index_t i{}; i < n_wordsPerBlock; ++i)
+                block.words[i] |= mask[i];
+#endif
+        }
     }
 
-    template<typename TT>
-    bool lookup(TT&& v) const
+    bool test(std::uint64_t v_hash) const
     {
-        const index_t v_hash(std::hash<T>(std::forward<TT>(v))());
+        const Block& block(blocks[blockIndex(v_hash)]);
 
-        for (index_t i{}; i < n_hashes; ++i)
-            if (!data[hash(i, v_hash)])
+#if defined(__AVX2__)
+        __m256i mask_low, mask_high;
+        blockMask(v_hash, mask_low, mask_high);
+
+        // testc is set iff every bit of the mask is set in the block
+        const __m256i* const words(reinterpret_cast<const __m256i*>(block.words));
+        return _mm256_testc_si256(_mm256_load_si256(&words[0]), mask_low) & _mm256_testc_si256(_mm256_load_si256(&words[1]), mask_high);
+#else
+        std::uint64_t mask[n_wordsPerBlock];
+        blockMask(v_hash, mask);
+
+        for (index_t i{}; i < n_wordsPerBlock; ++i)
+            if ((block.words[i] & mask[i]) != mask[i])
                 return false;
 
         return true;
+#endif
+    }
+
+    // Calls f(i, hash of vs[i]) for each i, after prefetching the blocks of the next n_batch keys
+    template<typename F>
+    void batch(std::span<const T> vs, F&& f) const
+    {
+        std::uint64_t v_hashes[n_batch];
+        for (index_t i_begin{}; i_begin < std::size(vs); i_begin += n_batch)
+        {
+            const n_t n(std::min(n_batch, std::size(vs) - i_begin));
+            for (index_t i{}; i < n; ++i)
+            {
+                v_hashes[i] = hash(vs[i_begin + i]);
+                prefetch(blocks[blockIndex(v_hashes[i])]);
+            }
+
+            for (index_t i{}; i < n; ++i)
+                f(i_begin + i, v_hashes[i]);
+        }
+    }
+
+    void checkOwned(const char functionName[]) const
+    {
+        if (blocks != std::begin(data))
+            throw std::logic_error("BloomFilter::" + std::string(functionName) + ": filter is memory mapped (read only)");
+    }
+
+    // this[i] = f(this[i], rhs[i]) for every word (or, with AVX2, every 256 bit vector of words) i
+    template<typename F>
+    void combine(const BloomFilter& rhs, const char functionName[], F&& f)
+    {
+        checkOwned(functionName);
+        if (n_blocks != rhs.n_blocks || seed != rhs.seed)
+            throw std::domain_error("BloomFilter::" + std::string(functionName) + ": filters have different sizes or seeds");
+
+#if defined(__AVX2__)
+        __m256i* const lhsWords(reinterpret_cast<__m256i*>(std::begin(data)));
+        const __m256i* const rhsWords(reinterpret_cast<const __m256i*>(rhs.blocks));
+        for (index_t i{}; i < n_blocks * n_wordsPerBlock / 4; ++i)
+            _mm256_store_si256(&lhsWords[i], f(_mm256_load_si256(&lhsWords[i]), _mm256_load_si256(&rhsWords[i])));
+#else
+        std::uint64_t* const lhsWords(std::begin(data)->words);
+        const std::uint64_t* const rhsWords(rhs.blocks->words);
+        for (index_t i{}; i < n_blocks * n_wordsPerBlock; ++i)
+            lhsWords[i] = f(lhsWords[i], rhsWords[i]);
+#endif
+    }
+
+public:
+    // Filters constructed with the same arguments (including seed) can be combined
+    BloomFilter(n_t estimatedNumberOfInsertions, double maxFalsePositiveProbability = 0.05, std::uint64_t seed = uniform_random_int())
+        : seed(seed)
+    {
+        // m = e n ln(1/p), rounded up to whole blocks
+        const double n_bits(std::exp(1.) * double(std::max(estimatedNumberOfInsertions, n_t(1))) * std::log(1 / maxFalsePositiveProbability));
+        n_blocks = std::max(n_t(std::ceil(n_bits / (n_wordsPerBlock * 64))), n_t(1));
+        data = Array<Block>(n_blocks);
+        blocks = std::begin(data);
+    }
+
+    // Maps a filter written by save, read only
+    BloomFilter(const char path[])
+        : mappedImage(path)
+    {
+        if (std::size(mappedImage) < sizeof(Header))
+            throw std::runtime_error("BloomFilter::BloomFilter: file too small");
+
+        const Header& header(*reinterpret_cast<const Header*>(std::begin(mappedImage)));
+
+        // byteOrder reads as its bytes reversed if the file was written on a host of the other byte order
+        if (header.byteOrder == 0x0807060504030201)
+            throw std::runtime_error("BloomFilter::BloomFilter: file was written with a different byte order");
+
+        if (header.magic != magic || header.version != version || header.byteOrder != byteOrder || header.n_wordsPerBlock != n_wordsPerBlock)
+            throw std::runtime_error("BloomFilter::BloomFilter: not a BloomFilter file, or an unsupported version");
+
+        if (header.n_blocks == 0 || std::size(mappedImage) != sizeof(Header) + header.n_blocks * sizeof(Block))
+            throw std::runtime_error("BloomFilter::BloomFilter: file is truncated");
+
+        seed = header.seed;
+        n_blocks = header.n_blocks;
+        blocks = reinterpret_cast<const Block*>(std::begin(mappedImage) + sizeof(Header));
+    }
+
+    // Copies are owned, so a mapped filter can be copied to be added to or merged into
+    BloomFilter(const BloomFilter& rhs)
+        : seed(rhs.seed), n_blocks(rhs.n_blocks), data(rhs.blocks, rhs.blocks + rhs.n_blocks), blocks(std::begin(data))
+    {}
+
+    BloomFilter(BloomFilter&&) = default;
+    BloomFilter& operator=(BloomFilter&&) = default;
+
+    void save(const char path[]) const
+    {
+        // Zeroed first, as the header is padded to a cache line and the padding is written too
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = magic;
+        header.version = version;
+        header.byteOrder = byteOrder;
+        header.seed = seed;
+        header.n_blocks = n_blocks;
+        header.n_wordsPerBlock = n_wordsPerBlock;
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(blocks), n_blocks * sizeof(Block));
+        if (!file)
+            throw std::runtime_error("BloomFilter::save: couldn't write " + std::string(path));
+    }
+
+    // Size of the table in bits
+    n_t bitSize() const
+    {
+        return n_blocks * n_wordsPerBlock * 64;
+    }
+
+    void add(const T& v)
+    {
+        checkOwned(__func__);
+        insert<false>(hash(v));
+    }
+
+    void add_concurrent(const T& v)
+    {
+        checkOwned(__func__);
+        insert<true>(hash(v));
+    }
+
+    void add_batch(std::span<const T> vs)
+    {
+        checkOwned(__func__);
+        batch(vs, [&](index_t, std::uint64_t v_hash){ insert<false>(v_hash); });
+    }
+
+    void add_batch_concurrent(std::span<const T> vs)
+    {
+        checkOwned(__func__);
+        batch(vs, [&](index_t, std::uint64_t v_hash){ insert<true>(v_hash); });
+    }
+
+    // Union, rhs must have the same size and seed
+    BloomFilter& operator|=(const BloomFilter& rhs)
+    {
+#if defined(__AVX2__)
+        combine(rhs, "operator|=", [](__m256i lhs, __m256i rhs){ return _mm256_or_si256(lhs, rhs); });
+#else
+        combine(rhs, "operator|=", [](std::uint64_t lhs, std::uint64_t rhs){ return lhs | rhs; });
+#endif
+        return *this;
+    }
+
+    // Intersection, rhs must have the same size and seed
+    // The false positive probability is that of the filter of the union of the key sets, not of the intersection
+    BloomFilter& operator&=(const BloomFilter& rhs)
+    {
+#if defined(__AVX2__)
+        combine(rhs, "operator&=", [](__m256i lhs, __m256i rhs){ return _mm256_and_si256(lhs, rhs); });
+#else
+        combine(rhs, "operator&=", [](std::uint64_t lhs, std::uint64_t rhs){ return lhs & rhs; });
+#endif
+        return *this;
+    }
+
+    bool lookup(const T& v) const
+    {
+        return test(hash(v));
+    }
+
+    // results[i] = lookup(vs[i])
+    void lookup_batch(std::span<const T> vs, std::span<bool> results) const
+    {
+        batch(vs, [&](index_t i, std::uint64_t v_hash){ results[i] = test(v_hash); });
     }
 };
 
 #if 0
 int main()
 {
-    BloomFilter<int> b;
+    BloomFilter<int> b(1000000, 0.01);
+    for (int i{}; i < 1000000; ++i)
+        b.add(i);
+
+    n_t falsePositives{};
+    for (int i(1000000); i < 2000000; ++i)
+        falsePositives += b.lookup(i);
+
+    return b.lookup(123) && falsePositives < 10000;
 }
 #endif
@@ -0,0 +1,349 @@
+#include "../utility/utility.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+template<typename Key, typename Value>
+class ConcurrentHashTable
+{
+    /*
+        A thread safe hash table for many readers and writers.
+
+        The table is split into n_shards independent linear probing hash tables, chosen by the high bits of the key's hash.
+        Writers lock their shard's mutex, so writers to different shards don't contend.
+
+        Readers never lock. Each shard has a sequence lock: a counter that a writer makes odd before modifying the shard and even again afterwards.
+        A reader reads the counter, probes the shard, then rereads the counter. If the counter was odd or has changed, a writer interfered and the reader retries.
+        Slots are accessed with relaxed atomics so the racy reads are well defined, hence Key and Value must be trivially copyable.
+
+        When a shard grows, readers may still be probing the old slot array, so it can't be freed until no reader can hold it.
+        Rather than tracking reader epochs, retired arrays are kept until the table is destroyed.
+        Arrays are only retired when they double in size, so the retired arrays of a shard take less space than its current array.
+        A shard that's mostly tombstones is instead rebuilt in place, within a write section, so readers retry rather than see it half rebuilt.
+    */
+
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>, "ConcurrentHashTable: keys and values must be trivially copyable");
+
+    static const n_t
+        n_shardsLog2{6},
+        n_shards{1 << n_shardsLog2},
+        n_initial{16};
+
+    enum State : std::uint8_t
+    {
+        empty,
+        full,
+        deleted
+    };
+
+    struct Slot
+    {
+        std::atomic<State> state{empty};
+        std::atomic<Key> k;
+        std::atomic<Value> v;
+    };
+
+    struct Slots
+    {
+        n_t n; // Power of two
+        std::unique_ptr<Slot[]> data;
+
+        Slots(n_t n)
+            : n(n), data(std::make_unique<Slot[]>(n))
+        {}
+    };
+
+    // Each shard gets its own cache line, so writers to one shard don't invalidate the sequence counters of its neighbours
+    struct alignas(64) Shard
+    {
+        std::atomic<std::uint64_t> sequence{};
+        std::atomic<Slots*> slots;
+
+        std::mutex mutex;
+        n_t
+            n_used{},
+            n_deleted{};
+
+        // The current slot array is the last element, the rest are retired
+        std::vector<std::unique_ptr<Slots>> allSlots;
+
+        Shard()
+        {
+            allSlots.push_back(std::make_unique<Slots>(n_initial));
+            slots.store(allSlots.back().get(), std::memory_order_relaxed);
+        }
+    };
+
+    std::unique_ptr<Shard[]> shards{std::make_unique<Shard[]>(n_shards)};
+
+
+    static std::uint64_t hash(const Key& k)
+    {
+        // splitmix64 finaliser, so both the high bits (shard) and low bits (slot) are well distributed
+        std::uint64_t h(std::hash<Key>{}(k));
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    Shard& shard(std::uint64_t h) const
+    {
+        return shards[h >> 64 - n_shardsLog2];
+    }
+
+    // Returns the slot containing k, or the first slot that k could be inserted into if absent
+    // Bounded by the number of slots, so torn reads by a reader can't loop forever
+    static Slot* find(const Slots& slots, std::uint64_t h, const Key& k, bool& found)
+    {
+        Slot* insertSlot{};
+        for (index_t i(h & slots.n - 1), probe{}; probe < slots.n; i = i + 1 & slots.n - 1, ++probe)
+        {
+            Slot& slot(slots.data[i]);
+            const State state(slot.state.load(std::memory_order_relaxed));
+            if (state == empty)
+            {
+                found = false;
+                return insertSlot ? insertSlot : &slot;
+            }
+
+            if (state == deleted)
+            {
+                if (!insertSlot)
+                    insertSlot = &slot;
+            }
+            else if (slot.k.load(std::memory_order_relaxed) == k)
+            {
+                found = true;
+                return &slot;
+            }
+        }
+
+        found = false;
+        return insertSlot;
+    }
+
+    // Writer side of the sequence lock. Requires the shard's mutex
+    template<typename F>
+    static void write(Shard& shard, F&& f)
+    {
+        const std::uint64_t sequence(shard.sequence.load(std::memory_order_relaxed));
+        shard.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        f();
+
+        shard.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Requires k to be absent from slots
+    static void insert(Slots& slots, const Key& k, const Value& v)
+    {
+        bool found;
+        Slot* slot(find(slots, hash(k), k, found));
+        slot->k.store(k, std::memory_order_relaxed);
+        slot->v.store(v, std::memory_order_relaxed);
+        slot->state.store(full, std::memory_order_relaxed);
+    }
+
+    static void grow(Shard& shard)
+    {
+        Slots& slots_old(*shard.allSlots.back());
+
+        // If the shard is mostly tombstones, rebuilding at the same size is enough, and can reuse the array
+        if (shard.n_used * 4 < slots_old.n)
+        {
+            struct Entry
+            {
+                Key k;
+                Value v;
+            };
+
+            std::vector<Entry> entries;
+            entries.reserve(shard.n_used);
+            for (index_t i{}; i < slots_old.n; ++i)
+            {
+                const Slot& slot(slots_old.data[i]);
+                if (slot.state.load(std::memory_order_relaxed) == full)
+                    entries.push_back({slot.k.load(std::memory_order_relaxed), slot.v.load(std::memory_order_relaxed)});
+            }
+
+            write(shard, [&]
+            {
+                for (index_t i{}; i < slots_old.n; ++i)
+                    slots_old.data[i].state.store(empty, std::memory_order_relaxed);
+
+                for (const Entry& entry : entries)
+                    insert(slots_old, entry.k, entry.v);
+            });
+
+            shard.n_deleted = 0;
+            return;
+        }
+
+        auto slots(std::make_unique<Slots>(slots_old.n * 2));
+
+        // The new array isn't visible to readers yet, so it can be filled outside of the write section
+        for (index_t i{}; i < slots_old.n; ++i)
+        {
+            const Slot& slot_old(slots_old.data[i]);
+            if (slot_old.state.load(std::memory_order_relaxed) == full)
+                insert(*slots, slot_old.k.load(std::memory_order_relaxed), slot_old.v.load(std::memory_order_relaxed));
+        }
+
+        write(shard, [&]
+        {
+            shard.slots.store(slots.get(), std::memory_order_release);
+        });
+
+        shard.n_deleted = 0;
+        shard.allSlots.push_back(std::move(slots));
+    }
+
+public:
+    void add(const Key& k, const Value& v)
+    {
+        const std::uint64_t h(hash(k));
+        Shard& shard(this->shard(h));
+        const std::lock_guard lock(shard.mutex);
+
+        // Keep the load factor (including tombstones) at most 1/2
+        if ((shard.n_used + shard.n_deleted + 1) * 2 > shard.allSlots.back()->n)
+            grow(shard);
+
+        bool found;
+        Slot* slot(find(*shard.allSlots.back(), h, k, found));
+        const State state(slot->state.load(std::memory_order_relaxed));
+
+        write(shard, [&]
+        {
+            slot->k.store(k, std::memory_order_relaxed);
+            slot->v.store(v, std::memory_order_relaxed);
+            slot->state.store(full, std::memory_order_relaxed);
+        });
+
+        if (!found)
+        {
+            ++shard.n_used;
+            if (state == deleted)
+                --shard.n_deleted;
+        }
+    }
+
+    std::optional<Value> lookup(const Key& k) const
+    {
+        const std::uint64_t h(hash(k));
+        const Shard& shard(this->shard(h));
+
+        for (;;)
+        {
+            const std::uint64_t sequence(shard.sequence.load(std::memory_order_acquire));
+            if (sequence & 1)
+                continue;
+
+            bool found;
+            const Slot* slot(find(*shard.slots.load(std::memory_order_acquire), h, k, found));
+            const Value v(found ? slot->v.load(std::memory_order_relaxed) : Value{});
+
+            // Order the slot reads before the sequence reread
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (shard.sequence.load(std::memory_order_relaxed) != sequence)
+                continue;
+
+            if (!found)
+                return std::nullopt;
+
+            return v;
+        }
+    }
+
+    void remove(const Key& k)
+    {
+        const std::uint64_t h(hash(k));
+        Shard& shard(this->shard(h));
+        const std::lock_guard lock(shard.mutex);
+
+        bool found;
+        Slot* slot(find(*shard.allSlots.back(), h, k, found));
+        if (!found)
+            return;
+
+        write(shard, [&]
+        {
+            slot->state.store(deleted, std::memory_order_relaxed);
+        });
+
+        --shard.n_used;
+        ++shard.n_deleted;
+    }
+};
+
+
+#if 0
+// Scaling benchmark: throughput for 1 to N threads at various read/write mixes
+int main()
+{
+    using clock = std::chrono::high_resolution_clock;
+
+    constexpr n_t
+        n_keys{1 << 20},
+        n_operationsPerThread{1 << 22};
+
+    // 1, 2, 4, ..., up to and including the number of hardware threads
+    const n_t n_threadsMax(std::max(std::thread::hardware_concurrency(), 1u));
+    std::vector<n_t> threadCounts;
+    for (n_t n_threads(1); n_threads < n_threadsMax; n_threads *= 2)
+        threadCounts.push_back(n_threads);
+
+    threadCounts.push_back(n_threadsMax);
+
+    for (const unsigned readPercentage : {50u, 90u, 99u, 100u})
+        for (const n_t n_threads : threadCounts)
+        {
+            ConcurrentHashTable<std::uint64_t, std::uint64_t> table;
+            for (std::uint64_t k{}; k < n_keys; k += 2)
+                table.add(k, k);
+
+            std::atomic<n_t> hits{};
+            std::vector<std::thread> threads;
+
+            const clock::time_point clock_start(clock::now());
+            for (index_t i_thread{}; i_thread < n_threads; ++i_thread)
+                threads.emplace_back([&, i_thread]
+                {
+                    std::default_random_engine UPRNG(static_cast<unsigned>(i_thread));
+                    std::uniform_int_distribution<std::uint64_t> keys(0, n_keys - 1);
+                    std::uniform_int_distribution<unsigned> percentage(0, 99);
+
+                    n_t hits_local{};
+                    for (index_t i{}; i < n_operationsPerThread; ++i)
+                    {
+                        const std::uint64_t k(keys(UPRNG));
+                        if (percentage(UPRNG) < readPercentage)
+                            hits_local += table.lookup(k).has_value();
+                        else if (k & 2)
+                            table.add(k, i);
+                        else
+                            table.remove(k);
+                    }
+
+                    hits += hits_local;
+                });
+
+            for (std::thread& thread : threads)
+                thread.join();
+
+            const double seconds(std::chrono::duration<double>(clock::now() - clock_start).count());
+            std::cout << readPercentage << "% reads, " << n_threads << " threads: " << n_threads * n_operationsPerThread / seconds / 1e6 << " Mops/s\n";
+        }
+}
+#endif
@@ -0,0 +1,196 @@
+#include "../utility/utility.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <type_traits>
+
+
+template<typename T, typename Fingerprint = std::uint16_t>
+class CuckooFilter
+{
+    /*
+        A cuckoo filter is a probabilistic membership querying data structure, like a bloom filter, but also supporting deletion.
+        Lookup may return falsely return positive with low probability.
+
+        Rather than the key, a small fingerprint of its hash is stored, in one of the n_slots slots of one of two buckets (as in CuckooHashTable).
+        The key isn't stored, so the alternate bucket of a stored fingerprint has to be computable from the fingerprint and its current bucket alone:
+            i_2 = (hash(fingerprint) - i_1) mod n_buckets
+        (partial-key cuckoo hashing), so each bucket is the other's alternate.
+        The usual i_1 xor hash(fingerprint) would need a power of two number of buckets, which can waste up to half of the table.
+
+        A lookup compares the key's fingerprint against the 2 n_slots slots of its buckets, so for f-bit fingerprints the false positive probability is about 2 n_slots / 2^f.
+        With 4 slots per bucket, the table can be filled to about 95%, so storage is about f / 0.95 bits per key:
+            f = 8:   3%      false positive probability, 8.4 bits per key (a bloom filter needs 7.3)
+            f = 16:  0.012%  false positive probability, 16.8 bits per key (a bloom filter needs 19)
+        so it's smaller than a bloom filter for false positive probabilities below about 3%.
+        Fingerprints are whole unsigned integers, so f is 8, 16 or 32; sizes in between (e.g. 12 bits, 0.2%) would need bit packed slots.
+
+        A key may be removed only if it was added (otherwise it may remove another key's matching fingerprint).
+        The filter can't grow, as the keys aren't stored to rehash, so add returns false when there's no room.
+    */
+
+    static_assert(std::is_unsigned_v<Fingerprint>, "CuckooFilter: fingerprints must be unsigned integers");
+
+    static const n_t
+        n_slots{4},
+        n_maxSearch{512};
+
+    static constexpr double maxLoadFactor{0.95};
+
+    using Bucket = std::array<Fingerprint, n_slots>; // 0 is an empty slot
+
+    // A bucket in the breadth first search, reached by moving the fingerprint in slot i_slot of the parent's bucket into this bucket
+    struct SearchNode
+    {
+        index_t i_bucket;
+        index_t i_parent; // -1 for the key's candidate buckets
+        index_t i_slot;
+    };
+
+    std::uint64_t seed{uniform_random_int()};
+    n_t n_entries{};
+    Array<Bucket> data;
+
+
+    static std::uint64_t uniform_random_int()
+    {
+        static std::mt19937_64 UPRNG(std::random_device{}());
+        static std::uniform_int_distribution<std::uint64_t> UID;
+
+        return UID(UPRNG);
+    }
+
+    static std::uint64_t mix(std::uint64_t h)
+    {
+        // splitmix64 finaliser
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    // The fingerprint is taken from the high bits of the hash and the bucket from the low bits, so they're independent
+    static Fingerprint fingerprint(std::uint64_t v_hash)
+    {
+        const Fingerprint fp(Fingerprint(v_hash >> 64 - bitSize_v<Fingerprint>));
+        return fp ? fp : 1;
+    }
+
+    index_t bucketIndex(std::uint64_t v_hash) const
+    {
+        return v_hash % std::size(data);
+    }
+
+    index_t alternateBucket(index_t i_bucket, Fingerprint fp) const
+    {
+        return (mix(fp) % std::size(data) + std::size(data) - i_bucket) % std::size(data);
+    }
+
+    static index_t find(const Bucket& bucket, Fingerprint fp)
+    {
+        for (index_t i{}; i < n_slots; ++i)
+            if (bucket[i] == fp)
+                return i;
+
+        return -1;
+    }
+
+public:
+    CuckooFilter(n_t estimatedNumberOfInsertions)
+        : data(n_t(double(estimatedNumberOfInsertions) / (n_slots * maxLoadFactor)) + 1)
+    {}
+
+    n_t size() const
+    {
+        return n_entries;
+    }
+
+    // Size of the table in bits
+    n_t bitSize() const
+    {
+        return std::size(data) * n_slots * bitSize_v<Fingerprint>;
+    }
+
+    // Returns false if the filter is too full to add v
+    bool add(const T& v)
+    {
+        const std::uint64_t v_hash(mix(std::hash<T>{}(v) ^ seed));
+        const Fingerprint fp(fingerprint(v_hash));
+
+        // Breadth first search for the shortest eviction path ending in a bucket with a free slot, as in CuckooHashTable
+        std::array<SearchNode, n_maxSearch> nodes;
+        n_t n_nodes{};
+
+        nodes[n_nodes++] = {bucketIndex(v_hash), index_t(-1), index_t(-1)};
+        nodes[n_nodes++] = {alternateBucket(bucketIndex(v_hash), fp), index_t(-1), index_t(-1)};
+
+        for (index_t i_node{}; i_node < n_nodes; ++i_node)
+        {
+            const Bucket& bucket(data[nodes[i_node].i_bucket]);
+            index_t i_slot_free(find(bucket, 0));
+            if (i_slot_free != -1)
+            {
+                // Carry out the moves from the end of the path, each one into the slot vacated by the previous
+                const SearchNode* node(&nodes[i_node]);
+                for (; node->i_parent != -1; node = &nodes[node->i_parent])
+                {
+                    Fingerprint& from(data[nodes[node->i_parent].i_bucket][node->i_slot]);
+                    data[node->i_bucket][i_slot_free] = from;
+                    from = 0;
+                    i_slot_free = node->i_slot;
+                }
+
+                data[node->i_bucket][i_slot_free] = fp;
+                ++n_entries;
+                return true;
+            }
+
+            for (index_t i_slot{}; i_slot < n_slots && n_nodes < n_maxSearch; ++i_slot)
+                nodes[n_nodes++] = {alternateBucket(nodes[i_node].i_bucket, bucket[i_slot]), i_node, i_slot};
+        }
+
+        return false;
+    }
+
+    bool lookup(const T& v) const
+    {
+        const std::uint64_t v_hash(mix(std::hash<T>{}(v) ^ seed));
+        const Fingerprint fp(fingerprint(v_hash));
+        const index_t i_bucket(bucketIndex(v_hash));
+
+        return find(data[i_bucket], fp) != -1 || find(data[alternateBucket(i_bucket, fp)], fp) != -1;
+    }
+
+    // v must have been added
+    void remove(const T& v)
+    {
+        const std::uint64_t v_hash(mix(std::hash<T>{}(v) ^ seed));
+        const Fingerprint fp(fingerprint(v_hash));
+        const index_t i_bucket(bucketIndex(v_hash));
+
+        for (const index_t i : {i_bucket, alternateBucket(i_bucket, fp)})
+        {
+            const index_t i_slot(find(data[i], fp));
+            if (i_slot != -1)
+            {
+                data[i][i_slot] = 0;
+                --n_entries;
+                return;
+            }
+        }
+    }
+};
+
+#if 0
+int main()
+{
+    CuckooFilter<int> f(1000000);
+    for (int i{}; i < 1000000; ++i)
+        f.add(i);
+
+    for (int i{}; i < 500000; ++i)
+        f.remove(i);
+
+    return f.lookup(750000) && !f.lookup(250000);
+}
+#endif
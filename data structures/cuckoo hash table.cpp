@@ -1,105 +1,733 @@
 #include "../utility/utility.h"
 #include <array>
-#include <random> 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 
+template<typename Key, typename Value>
 class CuckooHashTable
 {
-    struct Entry : public KV<int, int>
+    /*
+        A bucketised cuckoo hash table.
+
+        Every key has two candidate buckets (one per hash function) and may live in any of the n_slots slots of either.
+        Lookup checks at most two buckets, each of which is (ideally) a single cache line.
+
+        If both buckets are full on insertion, an existing entry is moved to its alternate bucket to make room, which may displace another, and so on.
+        Rather than a random walk of evictions, a breadth first search from the two candidate buckets finds the shortest such chain of moves (the eviction path),
+        which is then carried out from the end, so every move is into a free slot.
+        If no path of at most n_maxSearch buckets exists, the table doubles in size, with new hash seeds (retried up to n_maxAttempts times if the entries don't fit).
+        Keys whose std::hash values are equal share both buckets whatever the seeds and size, so more than 2 n_slots of them can never fit,
+        and adding one throws once n_maxGrowths doublings haven't made room for it.
+
+        With 4 slots per bucket, the table can be filled to about 95% before insertions start failing, compared with about 50% with 1 slot per bucket.
+    */
+
+    static const n_t
+        n_slots{4},
+        n_initial{16},  // Buckets
+        n_maxSearch{512},
+        n_maxAttempts{4},
+        n_maxGrowths{4};
+
+    struct alignas(64) Bucket
     {
-        bool useHash2;
+        std::uint8_t used{}; // Bit i set if slot i is in use
+        std::array<Key, n_slots> keys{};
+        std::array<Value, n_slots> values{};
+
+        bool full() const
+        {
+            return used == (1 << n_slots) - 1;
+        }
 
-        Entry() = default;
+        index_t freeSlot() const
+        {
+            for (index_t i{}; i < n_slots; ++i)
+                if (!(used & 1 << i))
+                    return i;
 
-        Entry(int k, int v, bool useHash2)
-            : KV(k, v), useHash2(useHash2)
-        {}
+            return -1;
+        }
+
+        index_t find(const Key& k) const
+        {
+            for (index_t i{}; i < n_slots; ++i)
+                if (used & 1 << i && keys[i] == k)
+                    return i;
+
+            return -1;
+        }
     };
 
+    // A bucket in the breadth first search, reached by moving the entry in slot i_slot of the parent's bucket into this bucket
+    struct SearchNode
+    {
+        index_t i_bucket;
+        index_t i_parent; // -1 for the key's candidate buckets
+        index_t i_slot;
+    };
 
-    static const n_t n{256};
+    n_t n_entries{};
 
-    int
-        a{1},
-        b{0},
-        a2{2},
-        b2{1};
+    std::uint64_t
+        seed1{uniform_random_int()},
+        seed2{uniform_random_int()};
 
-    std::array<Entry, n> data;
+    Array<Bucket> data{n_initial};
 
 
-    unsigned uniform_random_int()
+    static std::uint64_t uniform_random_int()
     {
         // std::random_device{} is a random number generator, operator() gives a random number used as a seed
         // UPRNG is a uniform psuedo random number generator using the seed
-        // The bind is useful when requesting many random numbers
 
-        static std::default_random_engine UPRNG(std::random_device{}());
-        static std::uniform_int_distribution<unsigned> UID(0, n);
+        static std::mt19937_64 UPRNG(std::random_device{}());
+        static std::uniform_int_distribution<std::uint64_t> UID;
 
         return UID(UPRNG);
     }
 
-    int hash(int k, bool useHash2 = false) const
+    static std::uint64_t mix(std::uint64_t h)
     {
-        if (useHash2)
-            return (k*a2 + b2) % n;
-        return (k*a + b) % n;
+        // splitmix64 finaliser
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
     }
 
-    void rehash()
+    index_t hash(const Key& k, bool useHash2 = false) const
     {
-        a = uniform_random_int();
-        b = uniform_random_int();
-        a2 = uniform_random_int();
-        b2 = uniform_random_int();
+        // Bucket counts are powers of two
+        return mix(std::hash<Key>{}(k) ^ (useHash2 ? seed2 : seed1)) & std::size(data) - 1;
+    }
 
-        // copy all values and reinsert them after clearing table (from inits)
-        decltype(data) data_copy;
-        data_copy = data;
-        std::fill(std::begin(data), std::end(data), Entry());
-        for (const Entry& entry : data_copy)
-            add(entry.k, entry.v);
+    index_t alternateBucket(const Key& k, index_t i_bucket) const
+    {
+        const index_t i_bucket1(hash(k));
+        return i_bucket1 != i_bucket ? i_bucket1 : hash(k, true);
+    }
+
+    // Finds the shortest eviction path ending in a bucket with a free slot, and carries it out
+    // Returns the bucket and slot made free for k, or {-1, -1} if there's no such path
+    interval_t makeRoom(const Key& k)
+    {
+        // Nodes are never removed, so the queue is a range of this array
+        std::array<SearchNode, n_maxSearch> nodes;
+        n_t n_nodes{};
+
+        nodes[n_nodes++] = {hash(k), index_t(-1), index_t(-1)};
+        nodes[n_nodes++] = {hash(k, true), index_t(-1), index_t(-1)};
+
+        for (index_t i_node{}; i_node < n_nodes; ++i_node)
+        {
+            const Bucket& bucket(data[nodes[i_node].i_bucket]);
+            if (!bucket.full())
+            {
+                // Carry out the moves from the end of the path, each one into the slot vacated by the previous
+                index_t i_slot_free(bucket.freeSlot());
+                for (const SearchNode* node(&nodes[i_node]); node->i_parent != -1; node = &nodes[node->i_parent])
+                {
+                    Bucket& to(data[node->i_bucket]);
+                    Bucket& from(data[nodes[node->i_parent].i_bucket]);
+
+                    to.keys[i_slot_free] = std::move(from.keys[node->i_slot]);
+                    to.values[i_slot_free] = std::move(from.values[node->i_slot]);
+                    to.used |= 1 << i_slot_free;
+                    from.used &= ~(1 << node->i_slot);
+
+                    i_slot_free = node->i_slot;
+                }
+
+                index_t i_root(i_node);
+                while (nodes[i_root].i_parent != -1)
+                    i_root = nodes[i_root].i_parent;
+
+                return {nodes[i_root].i_bucket, i_slot_free};
+            }
+
+            for (index_t i_slot{}; i_slot < n_slots && n_nodes < n_maxSearch; ++i_slot)
+                nodes[n_nodes++] = {alternateBucket(bucket.keys[i_slot], nodes[i_node].i_bucket), i_node, i_slot};
+        }
+
+        return {index_t(-1), index_t(-1)};
+    }
+
+    // Adds an entry for a key known not to be in the table. Returns false if there was no room
+    template<typename KK, typename VV>
+    bool insert(KK&& k, VV&& v)
+    {
+        const auto [i_bucket, i_slot](makeRoom(k));
+        if (i_bucket == -1)
+            return false;
+
+        Bucket& bucket(data[i_bucket]);
+        bucket.keys[i_slot] = std::forward<KK>(k);
+        bucket.values[i_slot] = std::forward<VV>(v);
+        bucket.used |= 1 << i_slot;
+        ++n_entries;
+        return true;
+    }
+
+    // Leaves the table unchanged if it throws
+    void grow()
+    {
+        Array<Bucket> data_old(std::move(data));
+        const n_t n_entries_old(n_entries);
+        const std::uint64_t
+            seed1_old(seed1),
+            seed2_old(seed2);
+
+        for (index_t i_attempt{}; i_attempt < n_maxAttempts; ++i_attempt)
+        {
+            data = Array<Bucket>(std::size(data_old) * 2);
+            n_entries = 0;
+            seed1 = uniform_random_int();
+            seed2 = uniform_random_int();
+
+            bool success(true);
+            for (Bucket& bucket : data_old)
+                for (index_t i_slot{}; i_slot < n_slots && success; ++i_slot)
+                    if (bucket.used & 1 << i_slot)
+                        success = insert(bucket.keys[i_slot], bucket.values[i_slot]);
+
+            if (success)
+                return;
+        }
+
+        data = std::move(data_old);
+        n_entries = n_entries_old;
+        seed1 = seed1_old;
+        seed2 = seed2_old;
+        throw std::length_error("CuckooHashTable::grow: too many keys with the same hash");
     }
 
 public:
-    void add(int k, int v, bool useHash2 = false, n_t attemptsLeft = n)
+    n_t size() const
     {
-        Entry& entry(data[hash(k, useHash2)]);
-        
-        if (!entry)
+        return n_entries;
+    }
+
+    template<typename KK, typename VV>
+    void add(KK&& k, VV&& v)
+    {
+        for (const bool useHash2 : {false, true})
         {
-            entry = Entry(k, v, useHash2);
-            return;
+            Bucket& bucket(data[hash(k, useHash2)]);
+            const index_t i_slot(bucket.find(k));
+            if (i_slot != -1)
+            {
+                bucket.values[i_slot] = std::forward<VV>(v);
+                return;
+            }
         }
 
-        if (attemptsLeft == 0)
+        for (index_t i_growth{}; !insert(k, v); ++i_growth)
         {
-            rehash();
-            add(k, v, useHash2);
-            return;
+            if (i_growth == n_maxGrowths)
+                throw std::length_error("CuckooHashTable::add: too many keys with the same hash");
+
+            grow();
         }
+    }
 
-        Entry old(entry);
-        entry = Entry(k, v, useHash2);
-        add(old.k, old.v, !old.useHash2, attemptsLeft - 1);
+    bool contains(const Key& k) const
+    {
+        return data[hash(k)].find(k) != -1 || data[hash(k, true)].find(k) != -1;
     }
 
-    int lookup(int k) const
+    const Value& lookup(const Key& k) const
     {
-        const Entry& entry(data[hash(k, false)]);
-        if (entry.init && entry.k == k)
-            return entry.v;
-        
-        const Entry& entry2(data[hash(k, true)]);
-        if (entry.init && entry2.k == k)
-            return entry2.v;
-        
+        for (const bool useHash2 : {false, true})
+        {
+            const Bucket& bucket(data[hash(k, useHash2)]);
+            const index_t i_slot(bucket.find(k));
+            if (i_slot != -1)
+                return bucket.values[i_slot];
+        }
+
         throw std::domain_error("CuckooHashTable::lookup: key not found");
     }
 
-    void remove(int k)
+    void remove(const Key& k)
+    {
+        for (const bool useHash2 : {false, true})
+        {
+            Bucket& bucket(data[hash(k, useHash2)]);
+            const index_t i_slot(bucket.find(k));
+            if (i_slot != -1)
+            {
+                bucket.used &= ~(1 << i_slot);
+                --n_entries;
+                return;
+            }
+        }
+    }
+};
+
+
+template<typename Key, typename Value>
+class ConcurrentCuckooHashTable
+{
+    /*
+        A thread safe variant of CuckooHashTable for many readers and writers.
+
+        Buckets are guarded by n_stripes lock stripes (bucket i is guarded by stripe i mod n_stripes), each of which is a version counter.
+        A stripe is locked by a writer by making its version odd, and unlocked by making it even again.
+
+        Readers never lock. A lookup reads the versions of its two buckets' stripes, reads the buckets, then rereads the versions.
+        If either version was odd or has changed, a writer interfered and the lookup retries.
+        Slots are accessed with relaxed atomics so the racy reads are well defined, hence Key and Value must be trivially copyable.
+
+        Writers lock only the stripes of the two buckets they're modifying.
+        Insertion into two full buckets searches for an eviction path without any locks, then carries out each move of the path under the locks of its two buckets,
+        checking that the entry being moved hasn't changed since the search. If it has, the insertion starts over.
+
+        Growing locks every stripe. Readers may still be reading the old bucket array, so (as in ConcurrentHashTable) retired arrays are kept until the table is destroyed.
+    */
+
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>, "ConcurrentCuckooHashTable: keys and values must be trivially copyable");
+
+    static const n_t
+        n_slots{4},
+        n_initial{16},  // Buckets
+        n_maxSearch{512},
+        n_stripes{1024};
+
+    struct alignas(64) Bucket
+    {
+        std::atomic<std::uint8_t> used{};
+        std::array<std::atomic<Key>, n_slots> keys;
+        std::array<std::atomic<Value>, n_slots> values;
+
+        bool isUsed(index_t i_slot) const
+        {
+            return used.load(std::memory_order_relaxed) & 1 << i_slot;
+        }
+
+        index_t freeSlot() const
+        {
+            for (index_t i{}; i < n_slots; ++i)
+                if (!isUsed(i))
+                    return i;
+
+            return -1;
+        }
+
+        index_t find(const Key& k) const
+        {
+            for (index_t i{}; i < n_slots; ++i)
+                if (isUsed(i) && keys[i].load(std::memory_order_relaxed) == k)
+                    return i;
+
+            return -1;
+        }
+
+        void set(index_t i_slot, const Key& k, const Value& v)
+        {
+            keys[i_slot].store(k, std::memory_order_relaxed);
+            values[i_slot].store(v, std::memory_order_relaxed);
+            used.store(used.load(std::memory_order_relaxed) | 1 << i_slot, std::memory_order_relaxed);
+        }
+
+        void clear(index_t i_slot)
+        {
+            used.store(used.load(std::memory_order_relaxed) & ~(1 << i_slot), std::memory_order_relaxed);
+        }
+    };
+
+    struct Buckets
+    {
+        n_t n; // Power of two
+        std::unique_ptr<Bucket[]> data;
+
+        Buckets(n_t n)
+            : n(n), data(std::make_unique<Bucket[]>(n))
+        {}
+    };
+
+    struct alignas(64) Stripe
     {
-        data[hash(k)].init = false;
+        std::atomic<std::uint64_t> version{};
+    };
+
+    struct SearchNode
+    {
+        index_t i_bucket;
+        index_t i_parent; // -1 for the key's candidate buckets
+        index_t i_slot;
+        Key k;            // The key in slot i_slot of the parent's bucket at the time of the search
+    };
+
+    const std::uint64_t
+        seed1{uniform_random_int()},
+        seed2{uniform_random_int()};
+
+    std::atomic<n_t> n_entries{};
+
+    std::unique_ptr<Stripe[]> stripes{std::make_unique<Stripe[]>(n_stripes)};
+
+    // The current bucket array is the last element of allBuckets, the rest are retired. allBuckets is guarded by the growth mutex
+    std::atomic<Buckets*> buckets;
+    std::vector<std::unique_ptr<Buckets>> allBuckets;
+    std::mutex growthMutex;
+
+
+    static std::uint64_t uniform_random_int()
+    {
+        static std::mt19937_64 UPRNG(std::random_device{}());
+        static std::uniform_int_distribution<std::uint64_t> UID;
+
+        return UID(UPRNG);
+    }
+
+    static std::uint64_t mix(std::uint64_t h)
+    {
+        // splitmix64 finaliser
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    index_t hash(const Buckets& buckets, const Key& k, bool useHash2 = false) const
+    {
+        return mix(std::hash<Key>{}(k) ^ (useHash2 ? seed2 : seed1)) & buckets.n - 1;
+    }
+
+    index_t alternateBucket(const Buckets& buckets, const Key& k, index_t i_bucket) const
+    {
+        const index_t i_bucket1(hash(buckets, k));
+        return i_bucket1 != i_bucket ? i_bucket1 : hash(buckets, k, true);
+    }
+
+    Stripe& stripe(index_t i_bucket) const
+    {
+        return stripes[i_bucket & n_stripes - 1];
+    }
+
+    static void lock(Stripe& stripe)
+    {
+        for (std::uint64_t version(stripe.version.load(std::memory_order_relaxed));;)
+        {
+            if (!(version & 1) && stripe.version.compare_exchange_weak(version, version + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                // Keep the writer's slot stores after the odd version, so a reader that sees them also sees the version change
+                std::atomic_thread_fence(std::memory_order_release);
+                return;
+            }
+
+            std::this_thread::yield();
+            version = stripe.version.load(std::memory_order_relaxed);
+        }
+    }
+
+    static void unlock(Stripe& stripe)
+    {
+        stripe.version.fetch_add(1, std::memory_order_release);
+    }
+
+    // Locks the stripes of two buckets in a consistent order (so writers can't deadlock), unlocking on destruction
+    class BucketLock
+    {
+        Stripe* first;
+        Stripe* second;
+
+    public:
+        BucketLock(const ConcurrentCuckooHashTable& table, index_t i_bucket1, index_t i_bucket2)
+            : first(&table.stripe(i_bucket1)), second(&table.stripe(i_bucket2))
+        {
+            if (second < first)
+                std::swap(first, second);
+
+            lock(*first);
+            if (second != first)
+                lock(*second);
+        }
+
+        BucketLock(const BucketLock&) = delete;
+
+        ~BucketLock()
+        {
+            if (second != first)
+                unlock(*second);
+
+            unlock(*first);
+        }
+    };
+
+    // Searches for the shortest eviction path for k without locking, and carries it out one move at a time
+    // Returns false if there's no such path. Returns true if the path was carried out or was invalidated by another writer, in either case the insertion should be retried
+    bool makeRoom(Buckets& buckets, const Key& k)
+    {
+        std::array<SearchNode, n_maxSearch> nodes;
+        n_t n_nodes{};
+
+        nodes[n_nodes++] = {hash(buckets, k), index_t(-1), index_t(-1), k};
+        nodes[n_nodes++] = {hash(buckets, k, true), index_t(-1), index_t(-1), k};
+
+        for (index_t i_node{}; i_node < n_nodes; ++i_node)
+        {
+            const Bucket& bucket(buckets.data[nodes[i_node].i_bucket]);
+            if (bucket.freeSlot() != -1)
+            {
+                // Carry out the moves from the end of the path
+                for (const SearchNode* node(&nodes[i_node]); node->i_parent != -1; node = &nodes[node->i_parent])
+                {
+                    Bucket& to(buckets.data[node->i_bucket]);
+                    Bucket& from(buckets.data[nodes[node->i_parent].i_bucket]);
+
+                    const BucketLock lock(*this, node->i_bucket, nodes[node->i_parent].i_bucket);
+                    if (this->buckets.load(std::memory_order_relaxed) != &buckets)
+                        return true;
+
+                    const index_t i_slot_free(to.freeSlot());
+                    if (i_slot_free == -1 || !from.isUsed(node->i_slot) || !(from.keys[node->i_slot].load(std::memory_order_relaxed) == node->k))
+                        return true;
+
+                    to.set(i_slot_free, node->k, from.values[node->i_slot].load(std::memory_order_relaxed));
+                    from.clear(node->i_slot);
+                }
+
+                return true;
+            }
+
+            for (index_t i_slot{}; i_slot < n_slots && n_nodes < n_maxSearch; ++i_slot)
+            {
+                if (!bucket.isUsed(i_slot))
+                    continue;
+
+                const Key k_evict(bucket.keys[i_slot].load(std::memory_order_relaxed));
+                nodes[n_nodes++] = {alternateBucket(buckets, k_evict, nodes[i_node].i_bucket), i_node, i_slot, k_evict};
+            }
+        }
+
+        return false;
+    }
+
+    void grow(const Buckets* buckets_full)
+    {
+        const std::lock_guard growthLock(growthMutex);
+
+        // Another writer may have already grown the table
+        if (buckets.load(std::memory_order_relaxed) != buckets_full)
+            return;
+
+        for (index_t i{}; i < n_stripes; ++i)
+            lock(stripes[i]);
+
+        // With every stripe locked, this is the only thread accessing the buckets, so the new array can be filled like a CuckooHashTable
+        for (n_t n_buckets(buckets_full->n * 2);; n_buckets *= 2)
+        {
+            auto buckets_new(std::make_unique<Buckets>(n_buckets));
+
+            bool success(true);
+            for (index_t i_bucket{}; i_bucket < buckets_full->n && success; ++i_bucket)
+            {
+                const Bucket& bucket(buckets_full->data[i_bucket]);
+                for (index_t i_slot{}; i_slot < n_slots && success; ++i_slot)
+                    if (bucket.isUsed(i_slot))
+                        success = insertUnlocked(*buckets_new, bucket.keys[i_slot].load(std::memory_order_relaxed), bucket.values[i_slot].load(std::memory_order_relaxed));
+            }
+
+            if (success)
+            {
+                buckets.store(buckets_new.get(), std::memory_order_release);
+                allBuckets.push_back(std::move(buckets_new));
+                break;
+            }
+        }
+
+        for (index_t i{}; i < n_stripes; ++i)
+            unlock(stripes[i]);
+    }
+
+    // Insertion for growth, where no other thread can access the new buckets
+    bool insertUnlocked(Buckets& buckets, const Key& k, const Value& v)
+    {
+        for (const bool useHash2 : {false, true})
+        {
+            Bucket& bucket(buckets.data[hash(buckets, k, useHash2)]);
+            const index_t i_slot(bucket.freeSlot());
+            if (i_slot != -1)
+            {
+                bucket.set(i_slot, k, v);
+                return true;
+            }
+        }
+
+        // Stripes are all held by this thread, so the path moves must not lock
+        std::array<SearchNode, n_maxSearch> nodes;
+        n_t n_nodes{};
+
+        nodes[n_nodes++] = {hash(buckets, k), index_t(-1), index_t(-1), k};
+        nodes[n_nodes++] = {hash(buckets, k, true), index_t(-1), index_t(-1), k};
+
+        for (index_t i_node{}; i_node < n_nodes; ++i_node)
+        {
+            Bucket& bucket(buckets.data[nodes[i_node].i_bucket]);
+            index_t i_slot_free(bucket.freeSlot());
+            if (i_slot_free != -1)
+            {
+                const SearchNode* node(&nodes[i_node]);
+                for (; node->i_parent != -1; node = &nodes[node->i_parent])
+                {
+                    Bucket& from(buckets.data[nodes[node->i_parent].i_bucket]);
+                    buckets.data[node->i_bucket].set(i_slot_free, node->k, from.values[node->i_slot].load(std::memory_order_relaxed));
+                    from.clear(node->i_slot);
+                    i_slot_free = node->i_slot;
+                }
+
+                buckets.data[node->i_bucket].set(i_slot_free, k, v);
+                return true;
+            }
+
+            for (index_t i_slot{}; i_slot < n_slots && n_nodes < n_maxSearch; ++i_slot)
+            {
+                const Key k_evict(bucket.keys[i_slot].load(std::memory_order_relaxed));
+                nodes[n_nodes++] = {alternateBucket(buckets, k_evict, nodes[i_node].i_bucket), i_node, i_slot, k_evict};
+            }
+        }
+
+        return false;
+    }
+
+public:
+    ConcurrentCuckooHashTable()
+    {
+        allBuckets.push_back(std::make_unique<Buckets>(n_initial));
+        buckets.store(allBuckets.back().get(), std::memory_order_relaxed);
+    }
+
+    n_t size() const
+    {
+        return n_entries.load(std::memory_order_relaxed);
+    }
+
+    void add(const Key& k, const Value& v)
+    {
+        for (;;)
+        {
+            Buckets& buckets(*this->buckets.load(std::memory_order_acquire));
+            const index_t
+                i_bucket1(hash(buckets, k)),
+                i_bucket2(hash(buckets, k, true));
+
+            {
+                const BucketLock lock(*this, i_bucket1, i_bucket2);
+                if (this->buckets.load(std::memory_order_relaxed) != &buckets)
+                    continue;
+
+                Bucket
+                    &bucket1(buckets.data[i_bucket1]),
+                    &bucket2(buckets.data[i_bucket2]);
+
+                // Update an existing entry
+                for (Bucket* bucket : {&bucket1, &bucket2})
+                {
+                    const index_t i_slot(bucket->find(k));
+                    if (i_slot != -1)
+                    {
+                        bucket->values[i_slot].store(v, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+
+                // Or add to a free slot
+                for (Bucket* bucket : {&bucket1, &bucket2})
+                {
+                    const index_t i_slot(bucket->freeSlot());
+                    if (i_slot != -1)
+                    {
+                        bucket->set(i_slot, k, v);
+                        n_entries.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+            }
+
+            // Both buckets are full
+            if (!makeRoom(buckets, k))
+                grow(&buckets);
+        }
+    }
+
+    std::optional<Value> lookup(const Key& k) const
+    {
+        for (;;)
+        {
+            const Buckets& buckets(*this->buckets.load(std::memory_order_acquire));
+            const index_t
+                i_bucket1(hash(buckets, k)),
+                i_bucket2(hash(buckets, k, true));
+
+            const Stripe
+                &stripe1(stripe(i_bucket1)),
+                &stripe2(stripe(i_bucket2));
+
+            const std::uint64_t
+                version1(stripe1.version.load(std::memory_order_acquire)),
+                version2(stripe2.version.load(std::memory_order_acquire));
+
+            if (version1 & 1 || version2 & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::optional<Value> v;
+            for (const index_t i_bucket : {i_bucket1, i_bucket2})
+            {
+                const Bucket& bucket(buckets.data[i_bucket]);
+                const index_t i_slot(bucket.find(k));
+                if (i_slot != -1)
+                {
+                    v = bucket.values[i_slot].load(std::memory_order_relaxed);
+                    break;
+                }
+            }
+
+            // Order the bucket reads before the version rereads
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (stripe1.version.load(std::memory_order_relaxed) == version1 && stripe2.version.load(std::memory_order_relaxed) == version2)
+                return v;
+        }
+    }
+
+    void remove(const Key& k)
+    {
+        for (;;)
+        {
+            Buckets& buckets(*this->buckets.load(std::memory_order_acquire));
+            const index_t
+                i_bucket1(hash(buckets, k)),
+                i_bucket2(hash(buckets, k, true));
+
+            const BucketLock lock(*this, i_bucket1, i_bucket2);
+            if (this->buckets.load(std::memory_order_relaxed) != &buckets)
+                continue;
+
+            for (const index_t i_bucket : {i_bucket1, i_bucket2})
+            {
+                Bucket& bucket(buckets.data[i_bucket]);
+                const index_t i_slot(bucket.find(k));
+                if (i_slot != -1)
+                {
+                    bucket.clear(i_slot);
+                    n_entries.fetch_sub(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            return;
+        }
     }
 };
@@ -0,0 +1,341 @@
+#include "../utility/utility.h"
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+#define FLAT_HASH_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+template<typename Key, typename Value>
+class FlatHashTable
+{
+    /*
+        An open addressing hash table in the style of Abseil's Swiss table.
+
+        Alongside the array of slots is an array of control bytes, one per slot:
+            empty   = 0b10000000
+            deleted = 0b11111110
+            full    = 0b0hhhhhhh, where h is the low 7 bits of the key's hash (H2)
+
+        The slots are split into groups of n_group consecutive slots.
+        The remaining bits of the hash (H1) pick the first group to probe, and further groups are probed triangularly.
+        A probe loads a group's control bytes and compares them all against H2 at once (one SIMD compare),
+        so only the slots whose H2 matches have their keys compared, and the probe sequence ends at the first group containing an empty slot.
+        With a load factor of at most 7/8, almost every lookup touches one cache line of control bytes and one of slots.
+    */
+
+    using ctrl_t = signed char;
+
+    static constexpr ctrl_t
+        empty{-128},
+        deleted{-2};
+
+#if defined(__AVX2__)
+    static constexpr n_t n_group{32};
+#elif defined(FLAT_HASH_TABLE_SSE2)
+    static constexpr n_t n_group{16};
+#else
+    static constexpr n_t n_group{8};
+#endif
+
+    // One bit per control byte of a group, set if that byte matched
+    class BitMask
+    {
+        std::uint32_t mask;
+
+    public:
+        constexpr BitMask(std::uint32_t mask)
+            : mask(mask)
+        {}
+
+        constexpr explicit operator bool() const noexcept
+        {
+            return mask != 0;
+        }
+
+        constexpr index_t lowest() const noexcept
+        {
+            return std::countr_zero(mask);
+        }
+
+        constexpr void clearLowest() noexcept
+        {
+            mask &= mask - 1;
+        }
+    };
+
+    class Group
+    {
+#if defined(__AVX2__)
+        __m256i ctrl;
+
+    public:
+        explicit Group(const ctrl_t* p)
+            : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)))
+        {}
+
+        BitMask match(ctrl_t h2) const
+        {
+            return std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(h2))));
+        }
+
+        BitMask matchEmpty() const
+        {
+            return std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(empty))));
+        }
+
+        BitMask matchEmptyOrDeleted() const
+        {
+            // Empty and deleted are the only control bytes with the sign bit set
+            return std::uint32_t(_mm256_movemask_epi8(ctrl));
+        }
+#elif defined(FLAT_HASH_TABLE_SSE2)
+        __m128i ctrl;
+
+    public:
+        explicit Group(const ctrl_t* p)
+            : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)))
+        {}
+
+        BitMask match(ctrl_t h2) const
+        {
+            return std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2))));
+        }
+
+        BitMask matchEmpty() const
+        {
+            return std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(empty))));
+        }
+
+        BitMask matchEmptyOrDeleted() const
+        {
+            // Empty and deleted are the only control bytes with the sign bit set
+            return std::uint32_t(_mm_movemask_epi8(ctrl));
+        }
+#else
+        // Portable fallback, treats 8 control bytes as one 64-bit word (SWAR)
+        static constexpr std::uint64_t
+            lsbs{0x0101010101010101},
+            msbs{0x8080808080808080};
+
+        std::uint64_t ctrl{};
+
+        // Gather the most significant bit of each byte into the low 8 bits
+        static std::uint32_t movemask(std::uint64_t v)
+        {
+            return std::uint32_t(((v & msbs) >> 7) * 0x0102040810204080 >> 56);
+        }
+
+    public:
+        explicit Group(const ctrl_t* p)
+        {
+            for (index_t i(n_group); i --> 0;)
+                ctrl = ctrl << 8 | std::uint8_t(p[i]);
+        }
+
+        BitMask match(ctrl_t h2) const
+        {
+            // Bytes equal to h2 become zero. Adding 0x7F to the low 7 bits of each byte can't carry into the next byte,
+            // so the sign bit of the sum (or'd with the byte itself) is clear exactly for the zero bytes
+            const std::uint64_t x(ctrl ^ lsbs * std::uint8_t(h2));
+            return movemask(~((x & ~msbs) + ~msbs | x));
+        }
+
+        BitMask matchEmpty() const
+        {
+            // Of the control bytes with the sign bit set, only empty has bit 1 clear
+            return movemask(ctrl & ~ctrl << 6);
+        }
+
+        BitMask matchEmptyOrDeleted() const
+        {
+            return movemask(ctrl);
+        }
+#endif
+    };
+
+
+    // Number of groups is a power of two, so H1 can be reduced with a mask
+    n_t n_groups{};
+    n_t n_used{};     // Full slots
+    n_t n_deleted{};  // Tombstones, which count towards the load factor until the next rehash
+
+    Array<ctrl_t> ctrl;
+    Array<std::pair<Key, Value>> slots;
+
+
+    static std::uint64_t hash(const Key& k)
+    {
+        // Mix the std::hash so that identity hashes of integers still spread over H1 and H2 (splitmix64 finaliser)
+        std::uint64_t h(std::hash<Key>{}(k));
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    static ctrl_t h2(std::uint64_t h)
+    {
+        return ctrl_t(h & 0x7F);
+    }
+
+    static index_t h1(std::uint64_t h)
+    {
+        return index_t(h >> 7);
+    }
+
+    n_t capacity() const
+    {
+        return n_groups * n_group;
+    }
+
+    // Returns the index of the slot containing k, or -1
+    index_t find(const Key& k) const
+    {
+        if (!n_groups)
+            return -1;
+
+        const std::uint64_t h(hash(k));
+        for (index_t i_group(h1(h) & n_groups - 1), probe{}; probe < n_groups; i_group = i_group + ++probe & n_groups - 1)
+        {
+            const Group group(&ctrl[i_group * n_group]);
+            for (BitMask match(group.match(h2(h))); match; match.clearLowest())
+            {
+                const index_t i(i_group * n_group + match.lowest());
+                if (slots[i].first == k)
+                    return i;
+            }
+
+            if (group.matchEmpty())
+                break;
+        }
+
+        return -1;
+    }
+
+    // Returns the index of the first empty or deleted slot in k's probe sequence. Requires a free slot to exist
+    index_t findInsertSlot(std::uint64_t h) const
+    {
+        for (index_t i_group(h1(h) & n_groups - 1), probe{};; i_group = i_group + ++probe & n_groups - 1)
+        {
+            const BitMask free(Group(&ctrl[i_group * n_group]).matchEmptyOrDeleted());
+            if (free)
+                return i_group * n_group + free.lowest();
+        }
+    }
+
+    void rehash(n_t n_groups_new)
+    {
+        Array<ctrl_t> ctrl_old(std::move(ctrl));
+        Array<std::pair<Key, Value>> slots_old(std::move(slots));
+        const n_t capacity_old(capacity());
+
+        n_groups = n_groups_new;
+        n_deleted = 0;
+        ctrl = Array<ctrl_t>(capacity());
+        slots = Array<std::pair<Key, Value>>(capacity());
+        std::fill(std::begin(ctrl), std::end(ctrl), empty);
+
+        for (index_t i{}; i < capacity_old; ++i)
+            if (ctrl_old[i] >= 0)
+            {
+                const std::uint64_t h(hash(slots_old[i].first));
+                const index_t i_new(findInsertSlot(h));
+                ctrl[i_new] = h2(h);
+                slots[i_new] = std::move(slots_old[i]);
+            }
+    }
+
+    void reserveOne()
+    {
+        // Keep the load factor (including tombstones) below 7/8
+        if ((n_used + n_deleted + 1) * 8 <= capacity() * 7)
+            return;
+
+        // If the table is mostly tombstones, cleaning them out is enough
+        if (n_groups && n_used * 2 < capacity())
+            rehash(n_groups);
+        else
+            rehash(n_groups ? n_groups * 2 : 1);
+    }
+
+public:
+    FlatHashTable() = default;
+
+    n_t size() const
+    {
+        return n_used;
+    }
+
+    template<typename KK, typename VV>
+    void add(KK&& k, VV&& v)
+    {
+        const index_t i_existing(find(k));
+        if (i_existing != -1)
+        {
+            slots[i_existing].second = std::forward<VV>(v);
+            return;
+        }
+
+        reserveOne();
+
+        const std::uint64_t h(hash(k));
+        const index_t i(findInsertSlot(h));
+        if (ctrl[i] == deleted)
+            --n_deleted;
+
+        ctrl[i] = h2(h);
+        slots[i] = {std::forward<KK>(k), std::forward<VV>(v)};
+        ++n_used;
+    }
+
+    bool contains(const Key& k) const
+    {
+        return find(k) != -1;
+    }
+
+    const Value& lookup(const Key& k) const
+    {
+        const index_t i(find(k));
+        if (i == -1)
+            throw std::domain_error("FlatHashTable::lookup: key not found");
+
+        return slots[i].second;
+    }
+
+    void remove(const Key& k)
+    {
+        const index_t i(find(k));
+        if (i == -1)
+            return;
+
+        // Probe sequences pass over deleted slots, so only an empty slot could end a probe sequence early.
+        // If this slot's group already has an empty slot, no probe sequence continues past this group, so the slot can be marked empty
+        const index_t i_group(i / n_group);
+        ctrl[i] = Group(&ctrl[i_group * n_group]).matchEmpty() ? empty : deleted;
+        if (ctrl[i] == deleted)
+            ++n_deleted;
+
+        slots[i] = {};
+        --n_used;
+    }
+};
+
+
+#if 0
+int main()
+{
+    FlatHashTable<int, int> table;
+    for (int i{}; i < 1000; ++i)
+        table.add(i, i * i);
+
+    table.remove(10);
+    return table.lookup(20) == 400 && !table.contains(10);
+}
+#endif
@@ -1,61 +1,149 @@
 #include "../utility/utility.h"
 #include <algorithm>
 #include <forward_list>
+#include <functional>
 
 
 template<typename T>
 class HashTable
 {
+    /*
+        A chained hash table that grows by doubling when the load factor exceeds n_maxLoadFactor.
+
+        Rather than rehashing every entry at once when growing, the old bucket array is kept and migrated into the new one n_migrate buckets at a time,
+        on every subsequent add and remove. Until a bucket is migrated, its entries are looked up in the old array.
+
+        Growth from n to 2n buckets happens at n * n_maxLoadFactor entries, and the next growth can't happen until another n * n_maxLoadFactor adds,
+        whereas the migration needs at most n / n_migrate operations, so a migration always finishes before the next one would start.
+        Thus every operation does O(1) work and lookups don't need to migrate anything (and can stay const).
+    */
+
     using Bucket = std::forward_list<KV<index_t, T>>;
-    
-    static const n_t n_data{256};
 
-    Bucket data[n_data];
+    static const n_t
+        n_initial{256},
+        n_maxLoadFactor{1},
+        n_migrate{2};
+
+    n_t n_entries{};
+
+    Array<Bucket> data{n_initial};
 
-    index_t hash(index_t k_hash) const
+    // Buckets of data_old with index below i_migrate have been moved into data
+    Array<Bucket> data_old;
+    index_t i_migrate{};
+
+    static index_t hash(const T& v)
     {
-        return k_hash % n_data;
+        return std::hash<T>{}(v);
     }
 
-    static Bucket::iterator find_before(Bucket& bucket, index_t value)
+    static index_t bucketIndex(index_t v_hash, const Array<Bucket>& buckets)
     {
-        if (std::begin(bucket) == std::end(bucket))
-            return std::end(bucket);
+        // Bucket counts are powers of two
+        return v_hash & std::size(buckets) - 1;
+    }
 
-        if (*std::begin(bucket) == value)
-            return bucket.before_begin();
+    bool migrating() const
+    {
+        return std::size(data_old) != 0;
+    }
 
-        return std::adjacent_find(std::begin(bucket), std::end(bucket), [&](auto const&, auto const& rhs)
+    // The bucket that currently holds the entries with the given hash
+    const Bucket& bucket(index_t v_hash) const
+    {
+        if (migrating())
         {
-            return rhs == value;
-        });
+            const index_t i_old(bucketIndex(v_hash, data_old));
+            if (i_old >= i_migrate)
+                return data_old[i_old];
+        }
+
+        return data[bucketIndex(v_hash, data)];
+    }
+
+    Bucket& bucket(index_t v_hash)
+    {
+        return const_cast<Bucket&>(std::as_const(*this).bucket(v_hash));
+    }
+
+    static typename Bucket::iterator find_before(Bucket& bucket, index_t v_hash, const T& v)
+    {
+        for (auto it_before(bucket.before_begin()), it(std::begin(bucket)); it != std::end(bucket); it_before = it++)
+            if (*it == v_hash && it->v == v)
+                return it_before;
+
+        return std::end(bucket);
+    }
+
+    void grow()
+    {
+        data_old = std::move(data);
+        data = Array<Bucket>(std::size(data_old) * 2);
+        i_migrate = 0;
+    }
+
+    void migrate()
+    {
+        if (!migrating())
+            return;
+
+        for (const index_t i_end(std::min(i_migrate + n_migrate, std::size(data_old))); i_migrate < i_end; ++i_migrate)
+        {
+            // Splice the nodes across, so migration doesn't allocate
+            Bucket& bucket_old(data_old[i_migrate]);
+            while (!bucket_old.empty())
+            {
+                Bucket& bucket_new(data[bucketIndex(bucket_old.front().k, data)]);
+                bucket_new.splice_after(bucket_new.before_begin(), bucket_old, bucket_old.before_begin());
+            }
+        }
+
+        if (i_migrate == std::size(data_old))
+            data_old = {};
     }
 
 public:
+    n_t size() const
+    {
+        return n_entries;
+    }
+
     template<typename TT>
     void add(TT&& v)
     {
-        const index_t v_hash(hash(std::hash<T>(v)()));
+        migrate();
+        if (!migrating() && n_entries >= std::size(data) * n_maxLoadFactor)
+            grow();
 
-        data[v_hash].emplace_front(k, std::forward<TT>(v));
+        const index_t v_hash(hash(v));
+        bucket(v_hash).emplace_front(v_hash, std::forward<TT>(v));
+        ++n_entries;
     }
 
     bool lookup(const T& v) const
     {
-        const index_t v_hash(hash(std::hash<T>(v)()));
+        const index_t v_hash(hash(v));
 
-        const Bucket& bucket(data[v_hash]);
-        auto it(std::find(std::begin(bucket), std::end(bucket), v_hash));
-        return it != std::end(bucket);
+        const Bucket& bucket(this->bucket(v_hash));
+        return std::any_of(std::begin(bucket), std::end(bucket), [&](const KV<index_t, T>& kv)
+        {
+            return kv == v_hash && kv.v == v;
+        });
     }
 
     void remove(const T& v)
     {
-        const index_t v_hash(hash(std::hash<T>(v)()));
+        migrate();
 
-        const Bucket& bucket(data[v_hash]);
-        auto it(find_before(bucket, v_hash));
+        const index_t v_hash(hash(v));
+
+        Bucket& bucket(this->bucket(v_hash));
+        auto it(find_before(bucket, v_hash, v));
         if (it != std::end(bucket))
+        {
             bucket.erase_after(it);
+            --n_entries;
+        }
     }
 };
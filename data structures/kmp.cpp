@@ -1,14 +1,166 @@
 #include "../utility/utility.h"
+#include "../utility/parallel.h"
+#include <bit>
+#include <cstdint>
 #include <deque>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+#define KMP_SSE2
+#include <emmintrin.h>
+#endif
 
 
 class KMP
 {
+    /*
+        getMismatches doesn't run the automaton over the whole text, most of which (for a typical search) can't be the start of a match.
+        Instead, two of the pattern's bytes that are expected to be rare in the text are chosen, at offsets i_rare[0] and i_rare[1] into the pattern.
+        The text is scanned for candidate match starts i with T[i + i_rare[0]] and T[i + i_rare[1]] equal to those bytes, n_vector positions at a time with SIMD.
+        The automaton is run from each candidate until its state drops back to 0 (no partial match in progress), when scanning resumes.
+        So text without candidates is skipped at around memory bandwidth, and every match is still found, as the automaton is run over every possible match.
+    */
+
+#if defined(__AVX2__)
+    static const n_t n_vector{32};
+#elif defined(KMP_SSE2)
+    static const n_t n_vector{16};
+#endif
+
     const char* P;
     n_t n_P;
     Array<index_t> border;
+    index_t i_rare[2]{};
+
+    // Rough frequency rank of a byte in typical (mostly ASCII text) data, higher is more common
+    static int byteFrequency(unsigned char c)
+    {
+        if (c == ' ')
+            return 255;
+        if (std::string_view("etaoinsrhl").find(char(c)) != std::string_view::npos)
+            return 200;
+        if ((c >= 'a' && c <= 'z') || c == '\n' || c == '\0')
+            return 150;
+        if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z'))
+            return 100;
+        if (c >= 0x20 && c < 0x7F)
+            return 60;
+
+        return 20;
+    }
+
+    // Runs the automaton from the candidate start T[i_T] until there's no partial match in progress, returns the position it stopped at
+    template<typename F>
+    index_t verify(const char T[], n_t n_T, index_t i_T, F&& f) const
+    {
+        index_t i_P(0);
+        do
+        {
+            while (i_P != -1 && P[i_P] != T[i_T])
+                i_P = border[i_P];
+
+            ++i_P;
+            ++i_T;
+            if (i_P >= n_P)
+            {
+                f(i_T - i_P);
+                i_P = border[i_P];
+            }
+        } while (i_P != 0 && i_T < n_T);
+
+        return i_T;
+    }
+
+#if defined(__AVX2__)
+    // Bit i is set if T[i] is a candidate match start
+    std::uint32_t candidates(const char T[]) const
+    {
+        const __m256i
+            eq0(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&T[i_rare[0]])), _mm256_set1_epi8(P[i_rare[0]]))),
+            eq1(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&T[i_rare[1]])), _mm256_set1_epi8(P[i_rare[1]])));
+
+        return std::uint32_t(_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)));
+    }
+#elif defined(KMP_SSE2)
+    // Bit i is set if T[i] is a candidate match start
+    std::uint32_t candidates(const char T[]) const
+    {
+        const __m128i
+            eq0(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&T[i_rare[0]])), _mm_set1_epi8(P[i_rare[0]]))),
+            eq1(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&T[i_rare[1]])), _mm_set1_epi8(P[i_rare[1]])));
+
+        return std::uint32_t(_mm_movemask_epi8(_mm_and_si128(eq0, eq1)));
+    }
+#endif
+
+    // Matches T[0..n_T-1] continuing from a partial match of i_P characters, calling f(i_offset + i) for each match starting at T[i]
+    // (i is negative for a match starting before T, in an earlier chunk). Returns the partial match at the end of T
+    template<typename F>
+    index_t match(const char T[], n_t n_T, index_t i_P, index_t i_offset, F&& f) const
+    {
+        for (index_t i_T(0); i_T < n_T;)
+        {
+            // Get next alignment or determine mismatch
+            while (i_P != -1 && P[i_P] != T[i_T])
+                i_P = border[i_P];
+
+            ++i_P;
+            ++i_T;
+            if (i_P >= n_P)
+            {
+                f(i_offset + i_T - i_P);
+                i_P = border[i_P];
+            }
+        }
+
+        return i_P;
+    }
 
 public:
+    // Matches the pattern against a text given as a sequence of chunks, in constant memory
+    // The partial match at the end of each chunk is carried over to the next, so matches spanning chunks are found
+    class Stream
+    {
+        const KMP& kmp;
+        index_t i_P{};
+        index_t i_offset{}; // Position in the text of the start of the next chunk
+
+    public:
+        Stream(const KMP& kmp)
+            : kmp(kmp)
+        {}
+
+        // Calls f(i) for the position i in the whole text of every match ending in the chunk
+        template<typename F>
+        void feed(const char chunk[], n_t n, F&& f)
+        {
+            i_P = kmp.match(chunk, n, i_P, i_offset, f);
+            i_offset += n;
+        }
+
+        // Writes the position of every match ending in the chunk to out, returns the end of the output
+        template<typename OutputIt>
+        OutputIt feedInto(const char chunk[], n_t n, OutputIt out)
+        {
+            feed(chunk, n, [&](index_t i){ *out++ = i; });
+            return out;
+        }
+
+        // Number of characters fed so far
+        n_t position() const
+        {
+            return i_offset;
+        }
+
+        void reset()
+        {
+            i_P = 0;
+            i_offset = 0;
+        }
+    };
+
     KMP(const char P[], n_t n)
         : P(P), n_P(n)
     {
@@ -45,28 +197,68 @@ public:
             else
                 border[i] = j;
         }
-    }
 
+        // Choose the two rarest bytes of the pattern (at different offsets, preferably different bytes) to scan for
+        for (index_t i(1); i < n; ++i)
+            if (byteFrequency(P[i]) < byteFrequency(P[i_rare[0]]))
+                i_rare[0] = i;
+
+        const auto cost([&](index_t i){ return byteFrequency(P[i]) + (P[i] == P[i_rare[0]]) * 256; });
+        i_rare[1] = i_rare[0] == 0 && n > 1;
+        for (index_t i{}; i < n; ++i)
+            if (i != i_rare[0] && cost(i) < cost(i_rare[1]))
+                i_rare[1] = i;
+    }
 
-    std::deque<index_t> getMismatches(const char T[], n_t n_T)
+    // Calls f(i) for the position i of every match in T
+    template<typename F>
+    void search(const char T[], n_t n_T, F&& f) const
     {
-        std::deque<index_t> matches;
+        if (n_P == 0)
+            return;
+
+        const index_t i_rareMax(std::max(i_rare[0], i_rare[1]));
+        index_t i_T{};
 
-        for (index_t i_T(0), i_P(0); i_T < n_T;)
+#if defined(__AVX2__) || defined(KMP_SSE2)
+        while (i_T + i_rareMax + n_vector <= n_T)
         {
-            // Get next alignment or determine mismatch
-            while (i_P != -1 && P[i_P] != T[i_T])
-                i_P = border[i_P];
+            const std::uint32_t mask(candidates(&T[i_T]));
+            if (mask)
+                i_T = verify(T, n_T, i_T + std::countr_zero(mask), f);
+            else
+                i_T += n_vector;
+        }
+#endif
 
-            ++i_P;
-            ++i_T;
-            if (i_P >= n_P)
-            {
-                matches.push_back(i_T - i_P);
-                i_P = border[i_P];
-            }
+        while (i_T + n_P <= n_T)
+        {
+            if (T[i_T + i_rare[0]] == P[i_rare[0]] && T[i_T + i_rare[1]] == P[i_rare[1]])
+                i_T = verify(T, n_T, i_T, f);
+            else
+                ++i_T;
         }
+    }
+
 
+    std::deque<index_t> getMismatches(const char T[], n_t n_T) const
+    {
+        std::deque<index_t> matches;
+        search(T, n_T, [&](index_t i){ matches.push_back(i); });
         return matches;
     }
+
+    // getMismatches split across n_threads threads
+    std::deque<index_t> getMismatches_parallel(const char T[], n_t n_T, n_t n_threads = parallel::threadCount()) const
+    {
+        return parallel::search<index_t>(T, n_T, n_P, [&](const char chunk[], n_t n_chunk, index_t i_chunk, auto&& report)
+        {
+            search(chunk, n_chunk, [&](index_t i){ report(i_chunk + i); });
+        }, [](index_t i){ return i; }, n_threads);
+    }
+
+    Stream stream() const
+    {
+        return Stream(*this);
+    }
 };
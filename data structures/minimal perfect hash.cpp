@@ -0,0 +1,237 @@
+#include "../utility/utility.h"
+#include "../utility/parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+
+template<typename Key>
+class MinimalPerfectHash
+{
+    /*
+        A minimal perfect hash function (BBHash), mapping a fixed set of n keys one to one onto [0, n), taking about 3 bits per key
+        (measured on 5M keys: 2.8 bits with gamma = 1, 3.1 with 1.5, 3.5 with the default 2, which trades space for fewer levels per lookup).
+        It doesn't store the keys, so keys outside of the set map to arbitrary indices.
+
+        The keys are hashed into a bit array of size gamma n (level 0). Bits hit by exactly one key are set, the keys that collided are passed on to level 1,
+        a bit array of size gamma times the number of collided keys, and so on. The few keys left after n_maxLevels levels are stored explicitly.
+        A key's index is the rank of its bit among the set bits of the concatenation of all levels.
+
+        Lookup hashes into level 0 and, with probability about 1 - e^(-1/gamma), continues to the next level. The rank is the number of set bits before the bit's
+        4096 bit superblock (64 bits per superblock), plus the number from there to its 512 bit block (16 bits per block), plus popcounts of the block's words.
+        That's about 4.7% over the bits rather than the 12.5% of a full count per block, and the superblock counts are small enough to stay cached,
+        so lookups are still a couple of cache misses.
+
+        Construction of a level marks keys' bits in parallel with atomic ors, so the result doesn't depend on the number of threads.
+    */
+
+    static const n_t
+        n_maxLevels{32},
+        n_wordsPerBlock{8},       // 512 bit rank blocks, one cache line
+        n_blocksPerSuperblock{8}; // 4096 bit superblocks, so counts within one fit in 16 bits
+
+    std::uint64_t seed;
+
+    // Bit offset of each level into bits, and its size in bits (a multiple of 64)
+    std::vector<index_t> levelOffsets;
+    std::vector<n_t> levelSizes;
+
+    std::vector<std::uint64_t> bits;
+
+    // Number of set bits in the blocks before each block
+    std::vector<n_t> superblockRanks;
+
+    // Number of set bits in the blocks before each block, from the start of its superblock
+    std::vector<std::uint16_t> blockRanks;
+
+    // Hashes of the keys left over after the last level, sorted. Their indices follow the set bits
+    std::vector<std::uint64_t> leftovers;
+    n_t n_ranked{};
+
+
+    static std::uint64_t hash(std::uint64_t k_hash, std::uint64_t seed)
+    {
+        // splitmix64 finaliser of the seeded key hash
+        std::uint64_t h(k_hash ^ seed);
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
+
+    std::uint64_t levelHash(std::uint64_t k_hash, index_t level) const
+    {
+        return hash(k_hash, seed + level * 0x9E3779B97F4A7C15);
+    }
+
+    bool testBit(index_t i) const
+    {
+        return bits[i / 64] >> i % 64 & 1;
+    }
+
+    index_t rank(index_t i) const
+    {
+        const index_t i_word(i / 64), i_block(i_word / n_wordsPerBlock);
+
+        n_t ret(superblockRanks[i_block / n_blocksPerSuperblock] + blockRanks[i_block]);
+        for (index_t i_w(i_block * n_wordsPerBlock); i_w < i_word; ++i_w)
+            ret += std::popcount(bits[i_w]);
+
+        return ret + std::popcount(bits[i_word] & (std::uint64_t(1) << i % 64) - 1);
+    }
+
+public:
+    MinimalPerfectHash(const Key keys[], n_t n, double gamma = 2, std::uint64_t seed = 0, n_t n_threads = parallel::threadCount())
+        : seed(seed)
+    {
+        n_threads = parallel::threadCount(n_threads);
+
+        std::vector<std::uint64_t> remaining(n);
+        parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+        {
+            for (index_t i(i_begin); i < i_end; ++i)
+                remaining[i] = std::hash<Key>{}(keys[i]);
+        }, n_threads);
+
+        for (index_t level{}; level < n_maxLevels && !remaining.empty(); ++level)
+        {
+            const n_t
+                n_levelWords(std::max((n_t(double(std::size(remaining)) * gamma) + 63) / 64, n_t(1))),
+                n_levelBits(n_levelWords * 64);
+
+            levelOffsets.push_back(std::size(bits) * 64);
+            levelSizes.push_back(n_levelBits);
+
+            // Mark the bits hit by at least one key, and those hit by more than one
+            std::vector<std::uint64_t>
+                hit(n_levelWords),
+                collided(n_levelWords);
+
+            parallel::forRanges(std::size(remaining), [&](index_t i_begin, index_t i_end, index_t)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                {
+                    const index_t i_bit(levelHash(remaining[i], level) % n_levelBits);
+                    const std::uint64_t mask(std::uint64_t(1) << i_bit % 64);
+                    if (std::atomic_ref(hit[i_bit / 64]).fetch_or(mask, std::memory_order_relaxed) & mask)
+                        std::atomic_ref(collided[i_bit / 64]).fetch_or(mask, std::memory_order_relaxed);
+                }
+            }, n_threads);
+
+            for (index_t i{}; i < n_levelWords; ++i)
+                bits.push_back(hit[i] & ~collided[i]);
+
+            // Keys whose bits collided go to the next level
+            std::vector<std::vector<std::uint64_t>> collidedKeys(n_threads);
+            parallel::forRanges(std::size(remaining), [&](index_t i_begin, index_t i_end, index_t i_thread)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                {
+                    const index_t i_bit(levelHash(remaining[i], level) % n_levelBits);
+                    if (collided[i_bit / 64] >> i_bit % 64 & 1)
+                        collidedKeys[i_thread].push_back(remaining[i]);
+                }
+            }, n_threads);
+
+            remaining.clear();
+            for (const std::vector<std::uint64_t>& keys : collidedKeys)
+                remaining.insert(std::end(remaining), std::cbegin(keys), std::cend(keys));
+        }
+
+        // Pad to a whole number of rank blocks, and count the set bits before each one
+        bits.resize((std::size(bits) + n_wordsPerBlock - 1) / n_wordsPerBlock * n_wordsPerBlock);
+        const n_t n_blocks(std::size(bits) / n_wordsPerBlock);
+        blockRanks.resize(n_blocks);
+        superblockRanks.resize(n_blocks / n_blocksPerSuperblock + 1);
+        n_ranked = 0;
+        for (index_t i_block{}; i_block < n_blocks; ++i_block)
+        {
+            if (i_block % n_blocksPerSuperblock == 0)
+                superblockRanks[i_block / n_blocksPerSuperblock] = n_ranked;
+
+            blockRanks[i_block] = std::uint16_t(n_ranked - superblockRanks[i_block / n_blocksPerSuperblock]);
+            for (index_t i(i_block * n_wordsPerBlock); i < (i_block + 1) * n_wordsPerBlock; ++i)
+                n_ranked += std::popcount(bits[i]);
+        }
+
+        leftovers = std::move(remaining);
+        std::sort(std::begin(leftovers), std::end(leftovers));
+        if (std::adjacent_find(std::cbegin(leftovers), std::cend(leftovers)) != std::cend(leftovers))
+            throw std::domain_error("MinimalPerfectHash::MinimalPerfectHash: duplicate key (or hash)");
+    }
+
+    n_t size() const
+    {
+        return n_ranked + std::size(leftovers);
+    }
+
+    // Total size of the function in bits
+    n_t bitSize() const
+    {
+        return (std::size(bits) + std::size(superblockRanks) + std::size(leftovers) + std::size(levelOffsets) + std::size(levelSizes)) * 64 + std::size(blockRanks) * 16;
+    }
+
+    index_t operator()(const Key& k) const
+    {
+        const std::uint64_t k_hash(std::hash<Key>{}(k));
+        for (index_t level{}; level < std::size(levelOffsets); ++level)
+        {
+            const index_t i_bit(levelOffsets[level] + levelHash(k_hash, level) % levelSizes[level]);
+            if (testBit(i_bit))
+                return rank(i_bit);
+        }
+
+        // If k isn't one of the keys, it may not be a leftover either, so clamp to [0, n)
+        if (leftovers.empty())
+            return 0;
+
+        const auto it(std::lower_bound(std::cbegin(leftovers), std::cend(leftovers), k_hash));
+        return n_ranked + std::min(index_t(it - std::cbegin(leftovers)), std::size(leftovers) - 1);
+    }
+};
+
+
+template<typename Key, typename Value>
+class MinimalPerfectHashTable
+{
+    // A static map from a fixed set of keys to values, storing only the values (in the order given by a minimal perfect hash of the keys)
+    // Looking up a key that isn't in the set gives the value of an arbitrary key
+
+    MinimalPerfectHash<Key> index;
+    Array<Value> values;
+
+public:
+    MinimalPerfectHashTable(const Array<KV<Key, Value>>& KVs, double gamma = 2, std::uint64_t seed = 0, n_t n_threads = parallel::threadCount())
+        : index(keys(KVs).begin(), std::size(KVs), gamma, seed, n_threads), values(std::size(KVs))
+    {
+        parallel::forRanges(std::size(KVs), [&](index_t i_begin, index_t i_end, index_t)
+        {
+            for (index_t i(i_begin); i < i_end; ++i)
+                values[index(KVs[i].k)] = KVs[i].v;
+        }, n_threads);
+    }
+
+    n_t size() const
+    {
+        return std::size(values);
+    }
+
+    const Value& lookup(const Key& k) const
+    {
+        if (!std::size(values))
+            throw std::domain_error("MinimalPerfectHashTable::lookup: key not found");
+
+        return values[index(k)];
+    }
+
+private:
+    static Array<Key> keys(const Array<KV<Key, Value>>& KVs)
+    {
+        Array<Key> ret(std::size(KVs));
+        std::transform(std::cbegin(KVs), std::cend(KVs), std::begin(ret), [](const KV<Key, Value>& kv){ return kv.k; });
+        return ret;
+    }
+};
@@ -1,32 +1,228 @@
 #include "../utility/utility.h"
+#include "../utility/parallel.h"
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+#if defined(_M_X64) && !defined(__SIZEOF_INT128__)
+#include <intrin.h>
+#endif
 
 class RabinKarp
 {
-	typedef unsigned hash_t;
+	/*
+		Finds every occurrence of any of a set of equal length patterns in a text, in O(n_T + number of matches) expected time.
+
+		Each length n_P window of the text is hashed with a rolling polynomial hash:
+			hash(c_0 .. c_{n-1}) = c_0 b^(n-1) + c_1 b^(n-2) + ... + c_{n-1}  mod p
+		so the next window's hash is computed from the previous one in constant time:
+			hash(c_1 .. c_n) = (hash(c_0 .. c_{n-1}) - c_0 b^(n-1)) b + c_n  mod p
+		and looked up among the hashes of the patterns. Windows with a matching hash are compared to the pattern to rule out collisions.
+
+		p is the Mersenne prime 2^61 - 1, so reducing a product mod p is a shift, a mask and an add rather than a division.
+		The base b is chosen at random, so for any two distinct strings of length n, the probability of a collision is at most n / p, whatever the input.
+		(A fixed base, or a modulus of 2^32 or 2^64, has inputs that collide on every window, e.g. Thue-Morse strings for 2^64.)
+
+		Nearly every window matches no pattern, so before looking a window's hash up in the hash table,
+		it's tested against a bit array with a bit set for each pattern hash (a one hash bloom filter), which fits in cache.
+	*/
+
+	typedef std::uint64_t hash_t;
+
+	static const hash_t modulus{(hash_t(1) << 61) - 1};
+
+	Array<Array<char>> Ps;
+	n_t n_P{ 0 };
+	hash_t base;
+	hash_t removeHashes[256]; // c b^(n_P-1) for each character c, to remove the first character of a window
+
+	// Pattern hashes to pattern indices
+	std::unordered_multimap<hash_t, index_t> hashes_P;
+	Array<std::uint64_t> hashBits;
+	hash_t hashBitsMask;
+
+	static hash_t uniform_random_hash()
+	{
+		static std::mt19937_64 UPRNG(std::random_device{}());
+		static std::uniform_int_distribution<hash_t> UID(256, modulus - 1);
+
+		return UID(UPRNG);
+	}
+
+	// x mod p for x < 2^63
+	static hash_t reduce(hash_t x)
+	{
+		x = (x & modulus) + (x >> 61);
+		return x >= modulus ? x - modulus : x;
+	}
 
-	Array<char> P;
-	n_t n_P;
-	hash_t hash_P{ 0 };
+	// a b mod p for a < 2p, b < p
+	static hash_t multiply(hash_t a, hash_t b)
+	{
+#if defined(__SIZEOF_INT128__)
+		const unsigned __int128 product((unsigned __int128)a * b);
+		const hash_t
+			low(static_cast<hash_t>(product)),
+			high(static_cast<hash_t>(product >> 64));
+#elif defined(_M_X64)
+		hash_t high;
+		const hash_t low(_umul128(a, b, &high));
+#else
+		const hash_t
+			a_low(a & 0xFFFFFFFF), a_high(a >> 32),
+			b_low(b & 0xFFFFFFFF), b_high(b >> 32),
+			middle(a_high * b_low + (a_low * b_low >> 32)),
+			middle2(a_low * b_high + (middle & 0xFFFFFFFF)),
+			low(a * b),
+			high(a_high * b_high + (middle >> 32) + (middle2 >> 32));
+#endif
+
+		// product = high 2^64 + low = (high 2^3 + low / 2^61) 2^61 + low mod 2^61, and 2^61 = 1 mod p
+		return reduce((low & modulus) + (high << 3 | low >> 61));
+	}
+
+	hash_t hash(const char s[]) const
+	{
+		hash_t ret(0);
+		for (index_t i(0); i < n_P; ++i)
+			ret = reduce(multiply(ret, base) + (unsigned char)s[i]);
+
+		return ret;
+	}
 
-	hash_t nextHash(hash_t oldHash, char firstCharacter, char lastCharacter)
+	hash_t nextHash(hash_t oldHash, char firstCharacter, char lastCharacter) const
 	{
-		return (oldHash - (firstCharacter << n_P - 1)) * 2 + lastCharacter; // Implicit modulo
+		return reduce(multiply(oldHash + modulus - removeHashes[(unsigned char)firstCharacter], base) + (unsigned char)lastCharacter);
+	}
+
+	bool maybePattern(hash_t hash_T) const
+	{
+		const hash_t i_bit(hash_T & hashBitsMask);
+		return hashBits[i_bit / 64] >> i_bit % 64 & 1;
+	}
+
+	void init()
+	{
+		n_P = std::size(Ps[0]);
+		for (const Array<char>& P : Ps)
+			if (std::size(P) != n_P)
+				throw std::domain_error("RabinKarp::RabinKarp: patterns must all be the same length");
+
+		if (n_P == 0)
+			throw std::domain_error("RabinKarp::RabinKarp: empty pattern");
+
+		base = uniform_random_hash();
+
+		hash_t power(1);
+		for (index_t i(1); i < n_P; ++i)
+			power = multiply(power, base);
+
+		for (index_t c(0); c < 256; ++c)
+			removeHashes[c] = multiply(c, power);
+
+		// At least 16 bits per pattern, so about 1 in 16 windows fail to be rejected by the bit array once it's full
+		n_t n_bits(64);
+		while (n_bits < std::size(Ps) * 16)
+			n_bits *= 2;
+
+		hashBits = Array<std::uint64_t>(n_bits / 64);
+		hashBitsMask = n_bits - 1;
+
+		for (index_t i(0); i < std::size(Ps); ++i)
+		{
+			const hash_t hash_P(hash(std::begin(Ps[i])));
+			hashes_P.emplace(hash_P, i);
+			hashBits[(hash_P & hashBitsMask) / 64] |= std::uint64_t(1) << (hash_P & hashBitsMask) % 64;
+		}
 	}
 
 public:
+	struct Match
+	{
+		index_t i_pattern;
+		index_t i_T; // Position of the start of the match in the text
+	};
+
 	RabinKarp(Array<char> P)
-		: P(P)
+		: Ps(1)
+	{
+		Ps[0] = std::move(P);
+		init();
+	}
+
+	RabinKarp(const char P[], n_t n)
+		: RabinKarp(Array<char>(P, P + n))
+	{}
+
+	// Patterns must all be the same length
+	RabinKarp(Array<Array<char>> Ps)
+		: Ps(std::move(Ps))
+	{
+		if (!std::size(this->Ps))
+			throw std::domain_error("RabinKarp::RabinKarp: no patterns");
+
+		init();
+	}
+
+	n_t size() const
+	{
+		return std::size(Ps);
+	}
+
+	// Length of the patterns
+	n_t length() const
+	{
+		return n_P;
+	}
+
+	// Calls f(Match) for every occurrence of every pattern, in order of position
+	template<typename F>
+	void search(const char T[], n_t n_T, F&& f) const
+	{
+		if (n_T < n_P)
+			return;
+
+		const auto check([&](hash_t hash_T, index_t i_T)
+		{
+			if (!maybePattern(hash_T))
+				return;
+
+			const auto range(hashes_P.equal_range(hash_T));
+			for (auto it(range.first); it != range.second; ++it)
+				if (std::memcmp(&T[i_T], std::begin(Ps[it->second]), n_P) == 0)
+					f(Match{ it->second, i_T });
+		});
+
+		hash_t hash_T(hash(T));
+		check(hash_T, 0);
+		for (index_t i_T(1); i_T + n_P <= n_T; ++i_T)
+		{
+			hash_T = nextHash(hash_T, T[i_T - 1], T[i_T + n_P - 1]);
+			check(hash_T, i_T);
+		}
+	}
+
+	std::deque<Match> getMatches(const char T[], n_t n_T) const
+	{
+		std::deque<Match> matches;
+		search(T, n_T, [&](const Match& match){ matches.push_back(match); });
+		return matches;
+	}
+
+	std::deque<Match> getMatches(const Array<char>& T) const
 	{
-		n_P = std::size(P);
-		for (char c : P)
-			hash_P = hash_P * 2 + c; // Implicit modulo
+		return getMatches(std::begin(T), std::size(T));
 	}
 
-	std::deque<index_t> getMatches(const Array<char>& T) const
+	// getMatches split across n_threads threads
+	std::deque<Match> getMatches_parallel(const char T[], n_t n_T, n_t n_threads = parallel::threadCount()) const
 	{
-		hash_t hash_T(0);
-		for (unsigned i(0); i < n_P; ++i)
-			hash_T = hash_T * 2 + T[i];
+		return parallel::search<Match>(T, n_T, n_P, [&](const char chunk[], n_t n_chunk, index_t i_chunk, auto&& report)
+		{
+			search(chunk, n_chunk, [&](const Match& match){ report(Match{ match.i_pattern, i_chunk + match.i_T }); });
+		}, [](const Match& match){ return match.i_T; }, n_threads);
 	}
 };
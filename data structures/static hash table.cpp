@@ -1,160 +1,296 @@
 #include "../utility/utility.h"
+#include "../utility/mapped file.h"
+#include "../utility/parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 
 
+template<typename Key, typename Value>
 class StaticHashTable
 {
-    class Subtable
-    {
-        // Hash parameters
-        unsigned
-            a{1},
-            b{0};
-
-        // Will have size n^2 where n is the number of actual values in this hash table
-        Array<int> data;
-        Array<bool> used;
-
-        index_t hash(int k) const
-        {
-            return (k*a + b) % std::size(data);
-        }
-
-        unsigned uniform_random_int()
-        {
-            // std::random_device{} is a random number generator, operator() gives a random number used as a seed
-            // UPRNG is a uniform psuedo random number generator using the seed
-            // The bind is useful when requesting many random numbers
-
-            static std::default_random_engine UPRNG(std::random_device{}());
-
-            return std::uniform_int_distribution<unsigned>(0, unsigned(std::size(data)))(UPRNG);
-        }
+    /*
+        A perfect hash table of a fixed set of keys (FKS hashing).
 
-        void nextHashParameters()
-        {
-            a = uniform_random_int();
-            b = uniform_random_int();
-        }
+        The keys are hashed into n buckets, with the hash function chosen such that the sum of the squares of the bucket sizes is at most 4n.
+        Each bucket i, containing n_i keys, is a subtable of n_i^2 slots, with its own hash function chosen such that there are no collisions.
+        So lookup is two hashes and no probing.
 
-    public:
-        Subtable(const Array<KV<int, int>>& KVs)
-        {
-            const n_t n(std::size(KVs));
+        The whole table is a single contiguous image with no pointers, only offsets from the start of the image:
+            Header
+            Subtable[n_buckets]  hash seed, offset into the slot array and slot count of each subtable
+            Slot[n_slots]        key, value, used
+        So it can be written to a file with save and memory mapped read only by any number of processes, which then share one copy of it.
+        Keys and values are copied byte for byte, so must be trivially copyable, and std::hash<Key> must give the same hashes in every process.
+        Everything is in the writer's byte order, recorded as byteOrder (read back as a different value on a host of another byte order).
+    */
 
-            data = Array<int>(n * n);
-            used = Array<bool>(n * n);
-
-            // Find hash function
-            reconstruct:
-            {
-                std::fill(std::begin(used), std::end(used), false);
-                for (const KV<int, int>& kv : KVs)
-                {
-                    // If found a collision, try again
-                    if (used[hash(kv.k)])
-                    {
-                        nextHashParameters();
-                        goto reconstruct;
-                    }
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>, "StaticHashTable: keys and values must be trivially copyable");
 
-                    used[hash(kv.k)] = true;
-                }
-            }
+    static constexpr std::uint64_t
+        magic{0x4C42544843545346}, // "FSTCHTBL"
+        version{2},
+        byteOrder{0x0102030405060708};
 
-            // Found hash function, add all the values to the hash table
-            for (const KV<int, int>& kv : KVs)
-                data[hash(kv.k)] = kv.v;
-        }
+    struct Header
+    {
+        std::uint64_t
+            magic,
+            version,
+            byteOrder,
+            keySize,
+            valueSize,
+            n,
+            seed,
+            n_slots,
+            subtablesOffset,
+            slotsOffset,
+            imageSize;
+    };
 
-        int lookup(int k) const
-        {
-            if (!used[hash(k)])
-                throw std::domain_error("StaticHashTable::Subtable::lookup: key not found");
+    struct Subtable
+    {
+        std::uint64_t
+            seed,
+            i_slots,
+            n_slots;
+    };
 
-            return data[hash(k)];
-        }
+    struct Slot
+    {
+        Key k;
+        Value v;
+        bool used;
     };
 
+    // Either owned or mapped
+    std::unique_ptr<std::byte[]> ownedImage;
+    MappedFile mappedImage;
+    const std::byte* image{};
 
-    const n_t n;
 
-    unsigned
-        a{1},
-        b{0};
-    
-    Array<Subtable> data;
+    static std::uint64_t hash(std::uint64_t k_hash, std::uint64_t seed)
+    {
+        // splitmix64 finaliser of the seeded key hash
+        std::uint64_t h(k_hash ^ seed);
+        h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9;
+        h = (h ^ h >> 27) * 0x94D049BB133111EB;
+        return h ^ h >> 31;
+    }
 
-    index_t hash(int k) const
+    static n_t alignUp(n_t offset, n_t alignment)
     {
-        return (k*a + b) % n;
+        return (offset + alignment - 1) / alignment * alignment;
     }
 
-    unsigned uniform_random_int()
+    const Header& header() const
     {
-        // std::random_device{} is a random number generator, operator() gives a random number used as a seed
-        // UPRNG is a uniform psuedo random number generator using the seed
-        // The bind is useful when requesting many random numbers
+        return *reinterpret_cast<const Header*>(image);
+    }
 
-        static std::default_random_engine UPRNG(std::random_device{}());
-        static std::uniform_int_distribution<unsigned> UID(0, unsigned(n));
+    const Subtable* subtables() const
+    {
+        return reinterpret_cast<const Subtable*>(image + header().subtablesOffset);
+    }
 
-        return UID(UPRNG);
+    const Slot* slots() const
+    {
+        return reinterpret_cast<const Slot*>(image + header().slotsOffset);
     }
 
-    void nextHashParameters()
+    void validate(n_t imageSize) const
     {
-        a = uniform_random_int();
-        b = uniform_random_int();
+        if (imageSize < sizeof(Header))
+            throw std::runtime_error("StaticHashTable::StaticHashTable: image too small");
+
+        const Header& header(this->header());
+
+        // byteOrder reads as its bytes reversed if the image was written on a host of the other byte order
+        if (header.byteOrder == 0x0807060504030201)
+            throw std::runtime_error("StaticHashTable::StaticHashTable: image was written with a different byte order");
+
+        if (header.magic != magic || header.version != version || header.byteOrder != byteOrder)
+            throw std::runtime_error("StaticHashTable::StaticHashTable: not a StaticHashTable image, or an unsupported version");
+
+        if (header.keySize != sizeof(Key) || header.valueSize != sizeof(Value))
+            throw std::runtime_error("StaticHashTable::StaticHashTable: image has different key or value types");
+
+        if (header.imageSize != imageSize)
+            throw std::runtime_error("StaticHashTable::StaticHashTable: image is truncated");
+
+        // The subtable and slot arrays must be aligned and lie within the image, so a corrupt header can't make lookups read outside it
+        const auto inImage([&](n_t offset, n_t alignment, n_t n_elements, n_t elementSize)
+        {
+            return offset % alignment == 0 && offset <= imageSize && n_elements <= (imageSize - offset) / elementSize;
+        });
+
+        if (!inImage(header.subtablesOffset, alignof(Subtable), header.n, sizeof(Subtable)) || !inImage(header.slotsOffset, alignof(Slot), header.n_slots, sizeof(Slot)))
+            throw std::runtime_error("StaticHashTable::StaticHashTable: image has a section outside the image or misaligned");
     }
-    
+
 public:
-    StaticHashTable(Array<KV<int, int>> KVs)
-        : n(std::size(KVs))
+    // Construction is parallelised over n_threads threads, and the resulting image depends only on the keys, values and seed
+    StaticHashTable(const Array<KV<Key, Value>>& KVs, std::uint64_t seed = std::random_device{}(), n_t n_threads = parallel::threadCount())
     {
-        // Array of number of collisions from keys
-        Array<n_t> hashCounts(n);
+        const n_t n(std::size(KVs));
+
+        n_threads = parallel::threadCount(n_threads);
+
+        Array<std::uint64_t> k_hashes(n);
+        parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+        {
+            for (index_t i(i_begin); i < i_end; ++i)
+                k_hashes[i] = std::hash<Key>{}(KVs[i].k);
+        }, n_threads);
+
+        // Find a top level hash function whose buckets have squared sizes summing to at most 4n (at least half of them do)
+        // The i'th attempt uses the seed hash(i, seed)
+        Array<n_t> bucketSizes(n);
+        Array<n_t> partialSums(n_threads);
+        std::uint64_t topSeed;
+        n_t n_slots;
+        for (std::uint64_t attempt{};; ++attempt)
+        {
+            topSeed = hash(attempt, seed);
+            std::fill(std::begin(bucketSizes), std::end(bucketSizes), 0);
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                    std::atomic_ref(bucketSizes[hash(k_hashes[i], topSeed) % n]).fetch_add(1, std::memory_order_relaxed);
+            }, n_threads);
+
+            std::fill(std::begin(partialSums), std::end(partialSums), 0);
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                    partialSums[i_thread] += bucketSizes[i] * bucketSizes[i];
+            }, n_threads);
+
+            n_slots = std::accumulate(std::cbegin(partialSums), std::cend(partialSums), n_t{});
+            if (n_slots <= 4 * n)
+                break;
+        }
+
+        // Lay out the image
+        const n_t
+            subtablesOffset(alignUp(sizeof(Header), alignof(Subtable))),
+            slotsOffset(alignUp(subtablesOffset + n * sizeof(Subtable), alignof(Slot))),
+            imageSize(slotsOffset + n_slots * sizeof(Slot));
+
+        // Value initialised, so padding bytes are zero
+        ownedImage = std::make_unique<std::byte[]>(imageSize);
+        image = ownedImage.get();
+
+        Header& header(*reinterpret_cast<Header*>(ownedImage.get()));
+        header = {magic, version, byteOrder, sizeof(Key), sizeof(Value), n, topSeed, n_slots, subtablesOffset, slotsOffset, imageSize};
+
+        Subtable* const subtables(reinterpret_cast<Subtable*>(ownedImage.get() + subtablesOffset));
+        Slot* const slots(reinterpret_cast<Slot*>(ownedImage.get() + slotsOffset));
+
+        // Sort the keys by bucket (counting sort), bucket i's keys are order[bucketBegins[i]..bucketBegins[i+1])
+        // The order of keys within a bucket depends on thread scheduling, but a subtable's contents don't depend on that order
+        Array<index_t> bucketBegins(n + 1);
+        for (index_t i{}, i_slots{}; i < n; ++i)
+        {
+            subtables[i] = {0, i_slots, bucketSizes[i] * bucketSizes[i]};
+            i_slots += subtables[i].n_slots;
+            bucketBegins[i + 1] = bucketBegins[i] + bucketSizes[i];
+        }
+
+        Array<index_t> order(n);
+        {
+            Array<index_t> bucketEnds(std::cbegin(bucketBegins), std::cend(bucketBegins) - 1);
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                    order[std::atomic_ref(bucketEnds[hash(k_hashes[i], topSeed) % n]).fetch_add(1, std::memory_order_relaxed)] = i;
+            }, n_threads);
+        }
 
-        // Find the hash parameters necessary to have less than n collisions
-        reconstruct:
+        // Find a collision free hash function for each subtable (at least half of them are)
+        // Subtables have disjoint slots, so can be built in parallel. The i'th attempt for bucket b uses the seed hash(i, hash(b, topSeed))
+        parallel::forEach(n, [&](index_t i_bucket)
         {
-            // Initialise hash counts
-            std::fill(std::begin(hashCounts), std::end(hashCounts), 0);
+            Subtable& subtable(subtables[i_bucket]);
+            Slot* const subtableSlots(slots + subtable.i_slots);
+            const std::uint64_t bucketSeed(hash(i_bucket, topSeed));
 
-            n_t collisions(0);
-            for (const KV<int, int>& kv : KVs)
+            for (std::uint64_t attempt{};; ++attempt)
             {
-                n_t& hashCount(hashCounts[hash(kv.k)]);
-                ++hashCount;
+                subtable.seed = hash(attempt, bucketSeed);
+                std::memset(subtableSlots, 0, subtable.n_slots * sizeof(Slot));
 
-                // Handle collisions
-                if (hashCount > 1)
+                bool collision(false);
+                for (index_t i_order(bucketBegins[i_bucket]); i_order < bucketBegins[i_bucket + 1]; ++i_order)
                 {
-                    // Require less than n collisions
-                    ++collisions;
-                    if (collisions >= n)
+                    const KV<Key, Value>& kv(KVs[order[i_order]]);
+                    Slot& slot(subtableSlots[hash(k_hashes[order[i_order]], subtable.seed) % subtable.n_slots]);
+
+                    // If found a collision, try again
+                    if (slot.used)
                     {
-                        nextHashParameters();
-                        goto reconstruct;
+                        if (slot.k == kv.k)
+                            throw std::domain_error("StaticHashTable::StaticHashTable: duplicate key");
+
+                        collision = true;
+                        break;
                     }
+
+                    std::memcpy(&slot.k, &kv.k, sizeof(Key));
+                    std::memcpy(&slot.v, &kv.v, sizeof(Value));
+                    slot.used = true;
                 }
+
+                if (!collision)
+                    return;
             }
-        }
+        }, n_threads);
+    }
 
-        // Add data to respective subtables
-        Array<Array<KV<int, int>>> table(n);
-        for (index_t i(0); i < n; ++i)
-            table[i] = Array<KV<int, int>>(hashCounts[i]);
+    // Maps an image written by save
+    StaticHashTable(const char path[])
+        : mappedImage(path), image(std::begin(mappedImage))
+    {
+        validate(std::size(mappedImage));
+    }
 
-        for (const KV<int, int>& kv : KVs)
-            table[hash(kv.k)].push_back({kv.k, kv.v});
+    void save(const char path[]) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(image), header().imageSize);
+        if (!file)
+            throw std::runtime_error("StaticHashTable::save: couldn't write " + std::string(path));
+    }
 
-        for (index_t i(0); i < n; ++i)
-            data[i] = Subtable(table[i]);
+    n_t size() const
+    {
+        return header().n;
     }
 
-    int lookup(int k) const
+    const Value& lookup(const Key& k) const
     {
-        return data[hash(k)].lookup(k);
+        const Header& header(this->header());
+        if (!header.n)
+            throw std::domain_error("StaticHashTable::lookup: key not found");
+
+        const std::uint64_t k_hash(std::hash<Key>{}(k));
+        const Subtable& subtable(subtables()[hash(k_hash, header.seed) % header.n]);
+        if (!subtable.n_slots)
+            throw std::domain_error("StaticHashTable::lookup: key not found");
+
+        const Slot& slot(slots()[subtable.i_slots + hash(k_hash, subtable.seed) % subtable.n_slots]);
+        if (!slot.used || !(slot.k == k))
+            throw std::domain_error("StaticHashTable::lookup: key not found");
+
+        return slot.v;
     }
 };
@@ -1,172 +1,743 @@
 #include "../utility/utility.h"
+#include "../utility/external sort.h"
+#include "../utility/mapped file.h"
+#include "../utility/packed array.h"
+#include "../utility/parallel.h"
 #include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 
+template<typename T>
+class MappedSuffixArray;
+
+template<typename T>
+class FMIndex;
+
 template<typename T>
 class SuffixArray
 {
-    // A custom radix sort that sorts keys such that their corresponding unsigned values are in ascending order, but with -1 as a special value that is the lowest
-    template<n_t n_elements = 1, n_t n_bits = sizeof(unsigned) * CHAR_BIT>
-    void radix_sort(index_t k[], unsigned v[], n_t n)
+    friend class MappedSuffixArray<T>;
+    friend class FMIndex<T>;
+
+    /*
+        File format written by save and mapped by MappedSuffixArray, with each section aligned to 64 bytes:
+            FileHeader
+            T[n]                                      the text
+            PackedArray(n, width)                     suffices
+            PackedArray(n, width) x 3 (if hasLCP)     lcp, lcpLeft, lcpRight
+        where width = ceil(log2 n) bits, enough for any index into the text.
+        The text and arrays are used in place, so loading is mapping the file and checking the header.
+        Everything is in the writer's byte order, recorded as byteOrder (read back as a different value on a host of another byte order).
+    */
+
+    static constexpr std::uint64_t
+        magic{0x5941524158465553}, // "SUFXARAY"
+        version{2},
+        byteOrder{0x0102030405060708};
+
+    struct FileHeader
+    {
+        std::uint64_t
+            magic,
+            version,
+            byteOrder,
+            characterSize,
+            n,
+            width,
+            hasLCP,
+            textOffset,
+            sufficesOffset,
+            lcpOffsets[3],
+            fileSize;
+    };
+
+    static n_t alignUp(n_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+
+    static n_t indexWidth(n_t n)
     {
-        for (index_t element(n_elements); element --> 0;)
-            for (index_t i(0); i < n_bits; ++i)
-                std::stable_partition(k, k + n, [v, element, i](index_t k) { return !(v[k + element] + 1 & 1 << i); });
+        return std::max(bitSize(n ? n - 1 : n_t(0)), n_t(1));
     }
 
-    index_t binary_search_min(const index_t suffices_indices[], n_t n, const unsigned v, const index_t i_data)
+    // Writes the file format for a text of n characters written by writeText(file), with suffix i given by suffix(i) (called for increasing i)
+    // and the LCP arrays given by lcps[0..2] if not null
+    template<typename WriteText, typename Suffix>
+    static void writeFile(const char path[], n_t n, WriteText&& writeText, Suffix&& suffix, const Array<index_t>* const lcps[3])
     {
-        index_t begin(0);
-        while (n > 0)
+        static_assert(std::is_trivially_copyable_v<T>, "SuffixArray: characters must be trivially copyable to be saved");
+
+        const n_t
+            width(indexWidth(n)),
+            packedSize(PackedArray::wordCount(n, width) * sizeof(std::uint64_t));
+
+        FileHeader header{magic, version, byteOrder, sizeof(T), n, width, lcps != nullptr};
+        header.textOffset = alignUp(sizeof(FileHeader));
+        header.sufficesOffset = alignUp(header.textOffset + n * sizeof(T));
+        header.fileSize = header.sufficesOffset + packedSize;
+        for (std::uint64_t& lcpOffset : header.lcpOffsets)
         {
-            const n_t step(n / 2);
-            const index_t i(begin + step);
-            const auto item(data[suffices[suffices_indices[i]] + i_data]);
-            if (item < v)
+            lcpOffset = 0;
+            if (lcps)
             {
-                begin = i + 1;
-                n -= step + 1;
+                lcpOffset = alignUp(header.fileSize);
+                header.fileSize = lcpOffset + packedSize;
             }
-            else
-                n = step;
         }
-        if (data[suffices[suffices_indices[begin]] + i_data] != v)
-            return n;
-        return begin;
+
+        std::ofstream file(path, std::ios::binary);
+        n_t position(0);
+        const auto seek([&](n_t offset)
+        {
+            for (; position < offset; ++position)
+                file.put(0);
+        });
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        position = sizeof(header);
+
+        seek(header.textOffset);
+        writeText(file);
+        position += n * sizeof(T);
+
+        seek(header.sufficesOffset);
+        PackedArray::write(file, n, width, suffix);
+        position += packedSize;
+
+        if (lcps)
+            for (index_t i(0); i < 3; ++i)
+            {
+                seek(header.lcpOffsets[i]);
+                PackedArray::write(file, n, width, [&](index_t j){ return (*lcps[i])[j]; });
+                position += packedSize;
+            }
+
+        if (!file)
+            throw std::runtime_error("SuffixArray::save: couldn't write " + std::string(path));
+    }
+
+    // Stable counting sort of the indices a[0..n-1] into b by their keys r[a[i]], each in [0, K]
+    static void radixPass(const index_t a[], index_t b[], const index_t r[], n_t n, n_t K)
+    {
+        Array<index_t> counts(K + 1);
+        for (index_t i(0); i < n; ++i)
+            ++counts[r[a[i]]];
+
+        for (index_t c(0), sum(0); c <= K; ++c)
+        {
+            const n_t count(counts[c]);
+            counts[c] = sum;
+            sum += count;
+        }
+
+        for (index_t i(0); i < n; ++i)
+            b[counts[r[a[i]]]++] = a[i];
+    }
+
+    /*
+        SA-IS (Nong, Zhang and Chan, 2009), linear time suffix sorting by induced sorting.
+
+        Let s be followed by a virtual sentinel, smaller than every character.
+        Suffix i is S-type if it's smaller than suffix i+1 and L-type if it's larger (the sentinel is S-type).
+        An S-type suffix preceded by an L-type suffix is a leftmost-S (LMS) suffix.
+
+        Given the LMS suffixes in sorted order, placed at the ends of their first character's bucket,
+        a left to right scan places each L-type suffix i-1 at the front of its bucket when suffix i is reached,
+        and a right to left scan then places each S-type suffix i-1 at the back of its bucket when suffix i is reached.
+        These induce the sorted order of all suffixes.
+
+        Inducing from the LMS suffixes in arbitrary order instead sorts the LMS substrings (from one LMS position to the next).
+        Naming each LMS suffix by the rank of its LMS substring gives a string of at most n/2 names whose suffix array is the order of the LMS suffixes,
+        which is found recursively (or directly, if the names are all distinct).
+
+        Besides the output, the only working memory is the n bits of types and the K character buckets at each level,
+        as the reduced string and its suffix array are stored in the output array.
+    */
+
+    static constexpr index_t empty{index_t(-1)};
+
+    // Sets bucket[c] to the index in SA of the start (or end) of character c's bucket
+    template<typename Char>
+    static void getBuckets(const Char s[], n_t n, Array<index_t>& buckets, bool end)
+    {
+        std::fill(std::begin(buckets), std::end(buckets), 0);
+        for (index_t i(0); i < n; ++i)
+            ++buckets[s[i]];
+
+        for (index_t c(0), sum(0); c < std::size(buckets); ++c)
+        {
+            sum += buckets[c];
+            buckets[c] = end ? sum : sum - buckets[c];
+        }
+    }
+
+    template<typename Char>
+    static void induce(const Char s[], index_t SA[], n_t n, const std::vector<bool>& types, Array<index_t>& buckets)
+    {
+        // L-type suffixes, left to right. The sentinel suffix (conceptually before SA[0]) induces suffix n-1, which is L-type
+        getBuckets(s, n, buckets, false);
+        SA[buckets[s[n - 1]]++] = n - 1;
+        for (index_t i(0); i < n; ++i)
+            if (SA[i] != empty && SA[i] > 0 && !types[SA[i] - 1])
+                SA[buckets[s[SA[i] - 1]]++] = SA[i] - 1;
+
+        // S-type suffixes, right to left
+        getBuckets(s, n, buckets, true);
+        for (index_t i(n); i --> 0;)
+            if (SA[i] != empty && SA[i] > 0 && types[SA[i] - 1])
+                SA[--buckets[s[SA[i] - 1]]] = SA[i] - 1;
+    }
+
+    // SA = the suffix array of s[0..n-1], whose characters are in [0, K)
+    template<typename Char>
+    static void sais(const Char s[], index_t SA[], n_t n, n_t K)
+    {
+        if (n == 0)
+            return;
+
+        // types[i] is true if suffix i is S-type, types[n] is the sentinel
+        std::vector<bool> types(n + 1);
+        types[n] = true;
+        for (index_t i(n - 1); i --> 0;)
+            types[i] = s[i] < s[i + 1] || s[i] == s[i + 1] && types[i + 1];
+
+        const auto isLMS([&](index_t i){ return i > 0 && types[i] && !types[i - 1]; });
+
+        // Sort the LMS substrings
+        Array<index_t> buckets(K);
+        getBuckets(s, n, buckets, true);
+        std::fill_n(SA, n, empty);
+        for (index_t i(1); i < n; ++i)
+            if (isLMS(i))
+                SA[--buckets[s[i]]] = i;
+
+        induce(s, SA, n, types, buckets);
+
+        // Move the sorted LMS substrings to SA[0..n_LMS-1]
+        n_t n_LMS(0);
+        for (index_t i(0); i < n; ++i)
+            if (isLMS(SA[i]))
+                SA[n_LMS++] = SA[i];
+
+        std::fill(SA + n_LMS, SA + n, empty);
+
+        // Name the LMS substrings by rank, 0 being the sentinel's. LMS positions are at least two apart, so the name of position i can be stored at SA[n_LMS + i/2]
+        n_t n_names(1);
+        for (index_t i(0), previous(empty); i < n_LMS; ++i)
+        {
+            const index_t position(SA[i]);
+            bool different(previous == empty);
+            for (index_t d(0); !different; ++d)
+            {
+                // The sentinel is unique, so a substring reaching it differs from every other
+                if (position + d == n || previous + d == n || s[position + d] != s[previous + d] || types[position + d] != types[previous + d])
+                    different = true;
+                else if (d > 0 && (isLMS(position + d) || isLMS(previous + d)))
+                    break;
+            }
+
+            if (different)
+            {
+                ++n_names;
+                previous = position;
+            }
+
+            SA[n_LMS + position / 2] = n_names - 1;
+        }
+
+        // Gather the names in text order at the end of SA, forming the reduced string (without the sentinel)
+        for (index_t i(n), j(n); i --> n_LMS;)
+            if (SA[i] != empty)
+                SA[--j] = SA[i];
+
+        index_t* const SA_LMS(SA);
+        index_t* const s_LMS(SA + n - n_LMS);
+
+        // Sort the LMS suffixes
+        if (n_names - 1 < n_LMS)
+        {
+            for (index_t i(0); i < n_LMS; ++i)
+                --s_LMS[i];
+
+            sais(s_LMS, SA_LMS, n_LMS, n_names - 1);
+        }
+        else
+            for (index_t i(0); i < n_LMS; ++i)
+                SA_LMS[s_LMS[i] - 1] = i;
+
+        // Map the sorted reduced suffixes back to LMS positions
+        for (index_t i(1), j(0); i < n; ++i)
+            if (isLMS(i))
+                s_LMS[j++] = i;
+
+        for (index_t i(0); i < n_LMS; ++i)
+            SA_LMS[i] = s_LMS[SA_LMS[i]];
+
+        std::fill(SA + n_LMS, SA + n, empty);
+
+        // Place the sorted LMS suffixes at the ends of their buckets, and induce the rest
+        getBuckets(s, n, buckets, true);
+        for (index_t i(n_LMS); i --> 0;)
+        {
+            const index_t j(SA[i]);
+            SA[i] = empty;
+            SA[--buckets[s[j]]] = j;
+        }
+
+        induce(s, SA, n, types, buckets);
+    }
+
+    void buildSAIS()
+    {
+        using Unsigned = std::make_unsigned_t<T>;
+
+        // Characters are ordered by their unsigned values
+        // Small alphabets (bytes) are used directly, others are first reduced to the ranks of the distinct characters
+        Unsigned max(0);
+        for (index_t i(0); i < n; ++i)
+            max = std::max(max, Unsigned(data[i]));
+
+        if (sizeof(T) == 1 || max < std::max(n, n_t(256)))
+        {
+            const Unsigned* const s(reinterpret_cast<const Unsigned*>(std::cbegin(data)));
+            sais(s, std::begin(suffices), n, n_t(max) + 1);
+            return;
+        }
+
+        std::vector<Unsigned> alphabet(std::cbegin(data), std::cbegin(data) + n);
+        std::sort(std::begin(alphabet), std::end(alphabet));
+        alphabet.erase(std::unique(std::begin(alphabet), std::end(alphabet)), std::end(alphabet));
+
+        Array<index_t> s(n);
+        for (index_t i(0); i < n; ++i)
+            s[i] = std::lower_bound(std::cbegin(alphabet), std::cend(alphabet), Unsigned(data[i])) - std::cbegin(alphabet);
+
+        sais(std::cbegin(s), std::begin(suffices), n, std::size(alphabet));
     }
 
-    index_t binary_search_max(const index_t suffices_indices[], n_t n, const unsigned v, const index_t i_data)
+    // lcp[i] = LCP of suffices i-1 and i (Kasai et al.), using the inverse suffix array, then LCP-LR from it
+    void buildLCPArrays()
     {
-        index_t begin(0);
-        while (n > 0)
+        lcp = Array<index_t>(n);
+        if (!n)
+            return;
+
+        Array<index_t> ranks(n);
+        for (index_t i(0); i < n; ++i)
+            ranks[suffices[i]] = i;
+
+        // The LCP of suffix i+1 with its predecessor is at least one less than that of suffix i, so h decreases by at most one per step
+        for (index_t i(0), h(0); i < n; ++i)
         {
-            const n_t step(n / 2);
-            const index_t i(begin + step);
-            if (data[suffices[suffices_indices[i]] + i_data] <= v)
+            if (ranks[i] == 0)
             {
-                begin = i + 1;
-                n -= step + 1;
+                h = 0;
+                continue;
+            }
+
+            const index_t j(suffices[ranks[i] - 1]);
+            while (i + h < n && j + h < n && data[i + h] == data[j + h])
+                ++h;
+
+            lcp[ranks[i]] = h;
+            if (h)
+                --h;
+        }
+
+        lcpLeft = Array<index_t>(n);
+        lcpRight = Array<index_t>(n);
+        buildLCPLR(index_t(-1), n);
+    }
+
+    /*
+        LCP-LR (Manber and Myers): query's binary search over suffices always probes the midpoint M of its current bounds (L, R), starting from (-1, n),
+        so each M is probed with only one pair of bounds. lcpLeft[M] and lcpRight[M] are the LCPs of suffix M with suffices L and R (0 for the virtual bounds -1 and n).
+        Sets them for the midpoints within (L, R), and returns the LCP of suffices L and R, the minimum of lcp[L+1..R].
+    */
+    index_t buildLCPLR(index_t L, index_t R)
+    {
+        const bool virtualBound(L == index_t(-1) || R == n);
+        if (R - L < 2)
+            return virtualBound ? 0 : lcp[R];
+
+        const index_t M(L + (R - L) / 2);
+        lcpLeft[M] = buildLCPLR(L, M);
+        lcpRight[M] = buildLCPLR(M, R);
+
+        return virtualBound ? 0 : std::min(lcpLeft[M], lcpRight[M]);
+    }
+
+    // State of a bound search: suffices up to L are before the bound and suffices from R are after it, l and r are their LCPs with the pattern
+    struct BoundState
+    {
+        index_t L, R, l, r;
+    };
+
+    // The states after each step of a bound search, and the number of characters of the pattern each step depended on
+    // A search for a pattern sharing the first h characters takes the same steps, so can resume after the steps that depended on at most h characters
+    struct BoundTrace
+    {
+        static const n_t n_maxSteps{bitSize_v<index_t> + 1};
+
+        n_t n_steps{};
+        BoundState states[n_maxSteps];
+        n_t dependencies[n_maxSteps];
+    };
+
+    /*
+        Index of the first suffix of s[0..n_s-1] (sorted by SA) whose first m characters are >= P (or > P if upper), in O(m + log n) character comparisons.
+        Characters are compared as unsigned values, as in construction.
+        Without LCP-LR (LCP_L and LCP_R null), the comparison with each suffix starts after min(l, r) characters, O(m log n) in the worst case.
+        If given a trace of the search for a pattern sharing the first h characters with P, resumes from it, and records this search into it.
+    */
+    template<bool upper, typename Suffices, typename LCPs>
+    static index_t bound(const T s[], n_t n_s, const Suffices& SA, const LCPs* LCP_L, const LCPs* LCP_R, const T P[], n_t m, BoundTrace* trace = nullptr, n_t h = 0)
+    {
+        using Unsigned = std::make_unsigned_t<T>;
+
+        BoundState state{index_t(-1), n_s, 0, 0};
+        index_t i_step(0);
+        if (trace)
+            for (; i_step < trace->n_steps && trace->dependencies[i_step] <= h; ++i_step)
+                state = trace->states[i_step];
+
+        auto& [L, R, l, r](state);
+        for (; R - L > 1; ++i_step)
+        {
+            const index_t M(L + (R - L) / 2);
+            n_t dependencies(0);
+
+            // If suffix M shares more (or less) with the bound with the longer LCP with P than P does, it's on the same side as (or the other side of) that bound
+            // Only if it shares exactly as much are its characters compared, from there
+            index_t k(-1);
+            if (!LCP_L)
+                k = std::min(l, r);
+            else if (l >= r)
+            {
+                const index_t lcp_L((*LCP_L)[M]);
+                if (lcp_L > l)
+                    L = M;
+                else if (lcp_L < l)
+                {
+                    R = M;
+                    r = lcp_L;
+                }
+                else
+                    k = l;
             }
             else
-                n = step;
+            {
+                const index_t lcp_R((*LCP_R)[M]);
+                if (lcp_R > r)
+                    R = M;
+                else if (lcp_R < r)
+                {
+                    L = M;
+                    l = lcp_R;
+                }
+                else
+                    k = r;
+            }
+
+            if (k != -1)
+            {
+                const index_t i(SA[M]);
+                while (k < m && i + k < n_s && s[i + k] == P[k])
+                    ++k;
+
+                // Depends on P[0..k], or on the end of P
+                dependencies = k + 1;
+
+                // Whether suffix M is before the bound
+                const bool before(k == m ? upper : i + k == n_s || Unsigned(s[i + k]) < Unsigned(P[k]));
+                if (before)
+                {
+                    L = M;
+                    l = k;
+                }
+                else
+                {
+                    R = M;
+                    r = k;
+                }
+            }
+
+            if (trace)
+            {
+                trace->states[i_step] = state;
+                trace->dependencies[i_step] = dependencies;
+            }
         }
-        if (!begin || data[suffices[suffices_indices[begin - 1]] + i_data] != v)
-            return 0;
-        return begin;
+
+        if (trace)
+            trace->n_steps = i_step;
+
+        return R;
     }
 
 public:
+    // Tag selecting the difference cover modulo 3 construction
+    struct DC3 {};
+
+    // Tag selecting the parallel prefix doubling construction
+    struct PrefixDoubling {};
+
     // The data and corresponding array of indices into the data, sorted in lexicographical order of the associated suffices
     const n_t n;
     Array<T> data;
     Array<index_t> suffices;
 
+    // lcp[i] is the length of the longest common prefix of suffices i-1 and i (lcp[0] = 0), empty until buildLCP is called
+    Array<index_t> lcp;
+
+private:
+    Array<index_t>
+        lcpLeft,
+        lcpRight;
+    bool builtLCP{};
+
+    // LCP-LR for bound, or null if not built
+    const Array<index_t>* lcpLR(bool right) const
+    {
+        return builtLCP ? (right ? &lcpRight : &lcpLeft) : nullptr;
+    }
+
+public:
+
+    // Constructs by induced sorting (SA-IS), O(n) time and n bits of working memory beyond the output
     SuffixArray(const Array<T>& input)
-        : n(std::size(input))
+        : n(std::size(input)), data(input), suffices(n)
+    {
+        static_assert(std::is_integral_v<T>, "SuffixArray: SA-IS construction needs an integral character type");
+        buildSAIS();
+    }
+
+    // Constructs by the difference cover modulo 3 algorithm, O(n) time
+    SuffixArray(const Array<T>& input, DC3)
+        : n(std::size(input)), data(input), suffices(n)
     {
+        static_assert(std::is_integral_v<T>, "SuffixArray: DC3 construction needs an integral character type");
+        buildDC3();
+    }
+
+    // Constructs by prefix doubling on n_threads threads, O(n log(max LCP)) work
+    SuffixArray(const Array<T>& input, PrefixDoubling, n_t n_threads = parallel::threadCount())
+        : n(std::size(input)), data(input), suffices(n)
+    {
+        static_assert(std::is_integral_v<T>, "SuffixArray: prefix doubling construction needs an integral character type");
+        prefixDoubling(n_threads);
+    }
+
+private:
     /*
-        _____input______|_______R_1_______|_______R_2_______|______R______
-        "abc""def""hij" | "bcd""efh""ij$" | "cde""fhi""j$$" | 1 2 4 5 7 8
-        "abc""def""hi$" | "bcd""efh""i$$" | "cde""fhi"      | 1 2 4 5 7
-        "abc""def""h$$" | "bcd""efh"      | "cde""fh$"      | 1 2 4 5
-        "abc""def"      | "bcd""ef$"      | "cde""f$$"      | 1 2 4 5
-        "abc""de$"      | "bcd""e$$"      | "cde"           | 1 2 4
-        "abc""d$$"      | "bcd"           | "cd$"           | 1 2
-        "abc"           | "bc$"           | "c$$"           | 1 2
-        "ab$"           | "b$$"           |                 | 1
-        "a$$"           | ""              | ""              | 
-        ""              | ""              | ""              |
+        Prefix doubling (Manber and Myers), with every step parallel: after the round for h, rank[i] is 1 plus the number of suffices whose first h characters are less than suffix i's.
+        The suffices are sorted by (rank[i], rank[i + h]) (0 past the end of the text) with parallel LSD radix sorts, giving their order by their first 2h characters.
+        The heads of runs of equal pairs are marked with their index plus one and a parallel max scan carries each head's mark across its run, which is the new rank.
+        Rounds stop when the ranks are all distinct, after O(log(max LCP)) rounds.
+        Each round is two radix sorts of ceil(log2(n + 1) / 8) byte passes, and the threads only share the counts between passes.
     */
-        
-        // Minimal suffix array
-        if (!n)
-            return;
+    void prefixDoubling(n_t n_threads)
+    {
+        using Unsigned = std::make_unsigned_t<T>;
 
-        // Allocate space for suffices
-        suffices = Array<index_t>(n);
+        // As forRanges clamps it, so per thread counts are indexed by the threads it runs
+        n_threads = std::max(std::min(n_threads, n), n_t(1));
 
-        // Allocated space for data, padded up to a length a multiple of three
-        const unsigned spill(n % 3);
-        if (!spill)
-            data = Array<T>(n); // No padding necessary
-        else
+        struct Entry
+        {
+            index_t rank, next, i;
+        };
+
+        Array<Entry> entries(n), buffer(n);
+        Array<index_t> rank(n), names(n);
+
+        const n_t rankBits(::bitSize(n));
+        const auto sort([&](n_t n_bits)
+        {
+            parallel::radixSort(std::begin(entries), std::begin(buffer), n, n_bits, [](const Entry& entry){ return entry.next; }, n_threads);
+            parallel::radixSort(std::begin(entries), std::begin(buffer), n, n_bits, [](const Entry& entry){ return entry.rank; }, n_threads);
+        });
+
+        // Names the sorted entries into rank, returning whether they're distinct
+        const auto name([&]()
+        {
+            std::vector<n_t> n_heads(n_threads);
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+            {
+                for (index_t j(i_begin); j < i_end; ++j)
+                {
+                    const bool head(j == 0 || entries[j].rank != entries[j - 1].rank || entries[j].next != entries[j - 1].next);
+                    names[j] = head ? j + 1 : 0;
+                    n_heads[i_thread] += head;
+                }
+            }, n_threads);
+
+            parallel::inclusiveScan(std::begin(names), n, [](index_t lhs, index_t rhs){ return std::max(lhs, rhs); }, n_threads);
+
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+            {
+                for (index_t j(i_begin); j < i_end; ++j)
+                    rank[entries[j].i] = names[j];
+            }, n_threads);
+
+            return std::accumulate(std::cbegin(n_heads), std::cend(n_heads), n_t(0)) == n;
+        });
+
+        parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
         {
-            // Padding necessary
-            const n_t padding(3 - spill);
-            data = Array<T>(n + padding);
-            std::fill_n(std::begin(data) + n, padding, -1); // Pad with FF's
+            for (index_t i(i_begin); i < i_end; ++i)
+                entries[i] = {index_t(Unsigned(data[i])), 0, i};
+        }, n_threads);
+        parallel::radixSort(std::begin(entries), std::begin(buffer), n, bitSize_v<Unsigned>, [](const Entry& entry){ return entry.rank; }, n_threads);
+
+        for (n_t h(1); !name(); h *= 2)
+        {
+            parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+            {
+                for (index_t i(i_begin); i < i_end; ++i)
+                    entries[i] = {rank[i], i + h < n ? rank[i + h] : 0, i};
+            }, n_threads);
+
+            sort(rankBits);
         }
 
-        // Copy input into data
-        std::copy(std::cbegin(input), std::cend(input), std::begin(data));
+        parallel::forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+        {
+            for (index_t j(i_begin); j < i_end; ++j)
+                suffices[j] = entries[j].i;
+        }, n_threads);
+    }
 
-        // There is no such thing as a good variable name...
-        // Let R_0, R_1, R_2 be triplets of characters from the input
-        // Let R_12 be the concatenation R_1 R_2, represented as triple-indices, sorted in lexicographical order
+    /*
+        DC3 (Karkkainen and Sanders, 2003), of s[0..n-1], whose characters are in [1, K], followed by s[n] = s[n+1] = s[n+2] = 0.
 
-        // Construct the arrays R_0, R_12
+        The suffixes at positions not divisible by 3 (i mod 3 = 1 or 2) are sorted first: they're named by the ranks of their first three characters (three radix passes),
+        and if the names aren't distinct, the string of the names of the suffixes at 1 mod 3 followed by those at 2 mod 3 (2/3 of the length) is sorted recursively,
+        as the order of its suffixes is the order of those suffixes.
+        The suffixes at 0 mod 3 are then sorted by (s[i], rank of suffix i+1), a radix pass over the order of the suffixes at 1 mod 3.
+        Merging compares a suffix at 0 mod 3 with one at 1 mod 3 by (s[i], rank[i+1]), and with one at 2 mod 3 by (s[i], s[i+1], rank[i+2]),
+        since those ranks are known for both. O(n) time, as each level is linear and the next is 2/3 of the size.
+    */
+    static void dc3(const index_t s[], index_t SA[], n_t n, n_t K)
+    {
         const n_t
-            n_R_0((n + 2) / 3),
-            n_R_12(n - n_R_0);
+            n_0((n + 2) / 3),
+            n_1((n + 1) / 3),
+            n_2(n / 3),
+            n_12(n_0 + n_2); // With a dummy suffix at 1 mod 3 (at n) if n is 1 mod 3, so that the 1 mod 3 names are followed by a unique smallest name
 
         Array<index_t>
-            R_0(n_R_0),
-            R_12(n_R_12);
+            s_12(n_12 + 3),
+            SA_12(n_12 + 3),
+            s_0(n_0),
+            SA_0(n_0);
 
-        // Initialise R_0
-        for (index_t i(0); i < n_R_0; ++i)
-            R_0[i] = i * 3;
+        for (index_t i(0), j(0); i < n + n_0 - n_1; ++i)
+            if (i % 3)
+                s_12[j++] = i;
 
-        // Initialise R_12
-        for (index_t i(0); i < n_R_12; ++i)
-            R_12[i] = i + i / 2 + 1;
+        radixPass(std::cbegin(s_12), std::begin(SA_12), s + 2, n_12, K);
+        radixPass(std::cbegin(SA_12), std::begin(s_12), s + 1, n_12, K);
+        radixPass(std::cbegin(s_12), std::begin(SA_12), s, n_12, K);
 
-        // Sort R_12 based on data
-        radix_sort<3>(&R_12[0], &data[0], n_R_12);
+        // Name the triples, writing the names of suffices at 1 mod 3 to the first half of s_12 and at 2 mod 3 to the second
+        n_t n_names(0);
+        for (index_t i(0), c_0(empty), c_1(empty), c_2(empty); i < n_12; ++i)
+        {
+            const index_t j(SA_12[i]);
+            if (s[j] != c_0 || s[j + 1] != c_1 || s[j + 2] != c_2)
+            {
+                ++n_names;
+                c_0 = s[j];
+                c_1 = s[j + 1];
+                c_2 = s[j + 2];
+            }
 
-        // Construct the suffix array of R_12
-        // This is the suffix array of B_1 U B_2
-        SuffixArray R_12_sa(R_12);
+            s_12[j % 3 == 1 ? j / 3 : j / 3 + n_0] = n_names;
+        }
 
-        // Let R be the index of an element of R_12 in R_12_sa
-        Array<index_t> R(n);
-        for (index_t i(0); i < n_R_12; ++i)
-            R[R_12_sa.data[i]] = i;
+        if (n_names < n_12)
+        {
+            dc3(std::cbegin(s_12), std::begin(SA_12), n_12, n_names);
+            for (index_t i(0); i < n_12; ++i)
+                s_12[SA_12[i]] = i + 1;
+        }
+        else
+            for (index_t i(0); i < n_12; ++i)
+                SA_12[s_12[i] - 1] = i;
+
+        for (index_t i(0), j(0); i < n_12; ++i)
+            if (SA_12[i] < n_0)
+                s_0[j++] = 3 * SA_12[i];
 
-        // Sort R_0, based on R + 1
-        radix_sort(&R_0[0], &R[1], n_R_0);
+        radixPass(std::cbegin(s_0), std::begin(SA_0), s, n_0, K);
 
-        // Sort R_0 based on data
-        radix_sort(&R_0[0], &data[0], n_R_0);
+        // Position in s of the suffix at SA_12[t]
+        const auto position12([&](index_t t){ return SA_12[t] < n_0 ? SA_12[t] * 3 + 1 : (SA_12[t] - n_0) * 3 + 2; });
 
-        // Merge R_0 with R_12 as the suffix array
+        for (index_t p(0), t(n_0 - n_1), k(0); k < n; ++k)
         {
-            index_t
-                i_R_0(0),
-                i_R_12(0);
+            const index_t
+                i(position12(t)),
+                j(SA_0[p]);
 
-            while (i_R_0 < n_R_0 && i_R_12 < n_R_12)
-            {
-                // Compare character
-                if (data[R_0[i_R_0]] < data[R_12[i_R_12]])
-                    suffices.push_back(R_0[i_R_0++]);
-                else if (data[R_12[i_R_12]] < data[R_0[i_R_0]])
-                    suffices.push_back(R_12[i_R_12++]);
+            const bool less12(SA_12[t] < n_0
+                ? std::pair(s[i], s_12[SA_12[t] + n_0]) <= std::pair(s[j], s_12[j / 3])
+                : std::tuple(s[i], s[i + 1], s_12[SA_12[t] - n_0 + 1]) <= std::tuple(s[j], s[j + 1], s_12[j / 3 + n_0]));
 
-                // Characters are equal, so compare rank of following suffix (which is known, as it is either in B_1 (for entry_R_0) or B_2 (for entry_R_1)
-                else if (R[R_0[i_R_0] + 1] < R[R_12[i_R_12] + 1])
-                    suffices.push_back(R_0[i_R_0++]);
-                else
-                    suffices.push_back(R_12[i_R_12++]);
+            if (less12)
+            {
+                SA[k] = i;
+                if (++t == n_12)
+                    for (++k; p < n_0; ++p, ++k)
+                        SA[k] = SA_0[p];
             }
-            if (i_R_0 < n_R_0)
-                std::copy(std::cbegin(R_0) + i_R_0, std::cend(R_0), suffices.current());
             else
-                std::copy(std::cbegin(R_12) + i_R_12, std::cend(R_12), suffices.current());
+            {
+                SA[k] = j;
+                if (++p == n_0)
+                    for (++k; t < n_12; ++t, ++k)
+                        SA[k] = position12(t);
+            }
+        }
+    }
+
+    void buildDC3()
+    {
+        using Unsigned = std::make_unsigned_t<T>;
+
+        if (n < 2)
+        {
+            if (n)
+                suffices[0] = 0;
+
+            return;
         }
+
+        // The ranks of the distinct characters, from 1, as 0 is the padding
+        std::vector<Unsigned> alphabet(std::cbegin(data), std::cbegin(data) + n);
+        std::sort(std::begin(alphabet), std::end(alphabet));
+        alphabet.erase(std::unique(std::begin(alphabet), std::end(alphabet)), std::end(alphabet));
+
+        Array<index_t> s(n + 3);
+        for (index_t i(0); i < n; ++i)
+            s[i] = std::lower_bound(std::cbegin(alphabet), std::cend(alphabet), Unsigned(data[i])) - std::cbegin(alphabet) + 1;
+
+        dc3(std::cbegin(s), std::begin(suffices), n, std::size(alphabet));
     }
 
+public:
     std::string operator[](const index_t i)
     {
         if (i >= n)
@@ -180,38 +751,579 @@ public:
         return ret;
     }
 
-    interval_t query(const unsigned input[], const n_t n_input)
+    /*
+        Builds lcp and the LCP-LR arrays (3n indices), which make query O(m + log n) rather than O(m log n) in the worst case, and are saved with the suffix array.
+        Not built by construction, as most texts have short LCPs, for which the plain binary search is about as fast. Does nothing if already built.
+    */
+    void buildLCP()
     {
-        // Binary search on each character such that begin is the first suffices index that prefixes the suffix and end is the last
+        if (builtLCP)
+            return;
 
-        // Sanity check
-        if (n_input > n || n_input == 0)
-            return {0, 0};
+        buildLCPArrays();
+        builtLCP = true;
+    }
 
-        const n_t
-            max_prefix(n - n_input), // The maximum number of characters that may occur before suffix for the suffix to be sufficiently long
-            n_suffices_indices(max_prefix + 1);
+    bool hasLCP() const
+    {
+        return builtLCP;
+    }
+
+    // The interval [begin, end) of suffices that start with P[0..m-1], in O(m + log n) time after buildLCP (O(m log n) otherwise) without allocating
+    interval_t query(const T P[], n_t m) const
+    {
+        return {bound<false>(std::cbegin(data), n, suffices, lcpLR(false), lcpLR(true), P, m), bound<true>(std::cbegin(data), n, suffices, lcpLR(false), lcpLR(true), P, m)};
+    }
+
+    // The positions of the occurrences of P in data (in suffix order, not position order), as a view of suffices
+    std::span<const index_t> occurrences(interval_t interval) const
+    {
+        return {std::cbegin(suffices) + interval.first, interval.second - interval.first};
+    }
 
-        // Indices of the suffices with sufficient length to be valid matches
-        Array<index_t> suffices_indices(n_suffices_indices);
-        for (index_t i(0), j(0); j < n_suffices_indices; ++i)
-            if (suffices[i] < n_suffices_indices)
-                suffices_indices[j++] = i; // Indices into suffices eh? ... Yes
+    std::span<const index_t> occurrences(const T P[], n_t m) const
+    {
+        return occurrences(query(P, m));
+    }
 
-        index_t
-            begin(0),
-            end(n_suffices_indices);
+    /*
+        results[i] = query(patterns[i]) for each i, using order (of the same size) as working space.
 
-        for (index_t i(0); i < n_input; ++i)
+        The patterns are sorted, and split into contiguous runs searched in parallel by n_threads threads.
+        Consecutive sorted patterns often share a prefix, and a bound search's steps up to the first that looked beyond the shared prefix are the same for both,
+        so each search resumes from the previous pattern's search where they diverge. The searches that remain visit the same, cached, parts of the arrays.
+    */
+    void query_batch(std::span<const std::span<const T>> patterns, std::span<interval_t> results, std::span<index_t> order, n_t n_threads = parallel::threadCount()) const
+    {
+        using Unsigned = std::make_unsigned_t<T>;
+
+        const auto less([](const T& lhs, const T& rhs){ return Unsigned(lhs) < Unsigned(rhs); });
+
+        std::iota(std::begin(order), std::end(order), index_t(0));
+        std::sort(std::begin(order), std::end(order), [&](index_t lhs, index_t rhs)
         {
-            begin += binary_search_min(&suffices_indices[begin], end - begin, input[i], i);
-            if (end <= begin)
-                return {0, 0};
-            end = begin + binary_search_max(&suffices_indices[begin], end - begin, input[i], i);
-            if (end <= begin)
+            return std::lexicographical_compare(std::cbegin(patterns[lhs]), std::cend(patterns[lhs]), std::cbegin(patterns[rhs]), std::cend(patterns[rhs]), less);
+        });
+
+        parallel::forRanges(std::size(patterns), [&](index_t i_begin, index_t i_end, index_t)
+        {
+            BoundTrace lowerTrace, upperTrace;
+            for (index_t i(i_begin); i < i_end; ++i)
+            {
+                const std::span<const T> P(patterns[order[i]]);
+
+                // Length of the prefix shared with the previous pattern (none for the first of the run)
+                n_t h(0);
+                if (i != i_begin)
+                {
+                    const std::span<const T> previous(patterns[order[i - 1]]);
+                    h = std::mismatch(std::cbegin(P), std::cend(P), std::cbegin(previous), std::cend(previous)).first - std::cbegin(P);
+                }
+
+                results[order[i]] =
+                {
+                    bound<false>(std::cbegin(data), n, suffices, lcpLR(false), lcpLR(true), std::data(P), std::size(P), &lowerTrace, h),
+                    bound<true>(std::cbegin(data), n, suffices, lcpLR(false), lcpLR(true), std::data(P), std::size(P), &upperTrace, h)
+                };
+            }
+        }, n_threads);
+    }
+
+    void query_batch(std::span<const std::span<const T>> patterns, std::span<interval_t> results, n_t n_threads = parallel::threadCount()) const
+    {
+        Array<index_t> order(std::size(patterns));
+        query_batch(patterns, results, {std::begin(order), std::size(order)}, n_threads);
+    }
+
+    // Writes the text, suffices and the LCP arrays (if buildLCP has been called) to a file that MappedSuffixArray maps, with indices packed into ceil(log2 n) bits
+    void save(const char path[]) const
+    {
+        const Array<index_t>* const lcps[]{&lcp, &lcpLeft, &lcpRight};
+        writeFile(path, n, [&](std::ostream& file){ file.write(reinterpret_cast<const char*>(std::cbegin(data)), n * sizeof(T)); }, [&](index_t i){ return suffices[i]; }, builtLCP ? lcps : nullptr);
+    }
+
+    /*
+        Builds the suffix array of the text in the file textPath (its raw characters) into the file outputPath in save's format, without the LCP arrays,
+        for texts larger than memory. Uses about memoryBudget bytes of memory, and temporary files in temporaryDirectory.
+
+        By prefix doubling: after the round for h, rank[i] is 1 plus the number of suffices whose first h characters are less than suffix i's.
+        Sorting the triples (rank[i], rank[i + h], i) and naming equal pairs equally gives the ranks for 2h characters, until the ranks are all distinct,
+        when the sorted triples' i are the suffix array.
+        rank[i] and rank[i + h] come from two sequential readers of the ranks in position order, h records apart, and the ranks are put back in position order with an external sort,
+        so every step is either a sequential scan or an external::sort. O(log(max LCP)) rounds, each O(n log n) work and about 64 n bytes of temporary files.
+    */
+    static void buildExternal(const char textPath[], const char outputPath[], n_t memoryBudget, const char temporaryDirectory[])
+    {
+        struct Triple
+        {
+            index_t rank, next, i;
+        };
+
+        struct Rank
+        {
+            index_t i, rank;
+        };
+
+        const auto byPair([](const Triple& lhs, const Triple& rhs){ return lhs.rank < rhs.rank || lhs.rank == rhs.rank && lhs.next < rhs.next; });
+        const auto byPosition([](const Rank& lhs, const Rank& rhs){ return lhs.i < rhs.i; });
+
+        const n_t n(std::filesystem::file_size(textPath) / sizeof(T));
+        external::TemporaryFiles temporaryFiles(temporaryDirectory);
+        const std::filesystem::path
+            triples(temporaryFiles.make()),
+            ranks(temporaryFiles.make());
+
+        // Characters ranked by themselves
+        {
+            external::Reader<T> text(textPath);
+            external::Writer<Triple> writer(triples);
+            for (index_t i(0); i < n; ++i)
+                writer.push({index_t(std::make_unsigned_t<T>(text.pop())), 0, i});
+            writer.flush();
+        }
+
+        for (n_t h(1);; h *= 2)
+        {
+            external::sort<Triple>(triples, triples, byPair, memoryBudget, temporaryFiles);
+
+            n_t n_distinct(0);
+            {
+                external::Reader<Triple> reader(triples);
+                external::Writer<Rank> writer(ranks);
+                Triple previous{};
+                index_t rank(0);
+                for (index_t j(0); j < n; ++j)
+                {
+                    const Triple triple(reader.pop());
+                    if (j == 0 || triple.rank != previous.rank || triple.next != previous.next)
+                    {
+                        rank = j + 1;
+                        ++n_distinct;
+                    }
+
+                    writer.push({triple.i, rank});
+                    previous = triple;
+                }
+                writer.flush();
+            }
+
+            if (n_distinct == n)
+                break;
+
+            external::sort<Rank>(ranks, ranks, byPosition, memoryBudget, temporaryFiles);
+
+            // Pair each rank with the rank h positions on, 0 (less than any rank) past the end of the text
+            external::Reader<Rank> reader(ranks), ahead(ranks, h);
+            external::Writer<Triple> writer(triples);
+            for (index_t i(0); i < n; ++i)
+                writer.push({reader.pop().rank, i + h < n ? ahead.pop().rank : 0, i});
+            writer.flush();
+        }
+
+        external::Reader<Triple> sorted(triples);
+        writeFile(outputPath, n, [&](std::ostream& file)
+        {
+            // Exactly the n characters the offsets were computed for, ignoring a trailing partial character
+            std::ifstream text(textPath, std::ios::binary);
+            std::vector<char> block(external::n_blockBytes);
+            for (n_t n_left(n * sizeof(T)); n_left;)
+            {
+                const n_t n_block(std::min(n_left, std::size(block)));
+                if (!text.read(std::data(block), n_block))
+                    throw std::runtime_error("SuffixArray::buildExternal: couldn't read " + std::string(textPath));
+
+                file.write(std::data(block), n_block);
+                n_left -= n_block;
+            }
+        }, [&](index_t){ return sorted.pop().i; }, nullptr);
+    }
+
+    // Suffix i (in sorted order), as a view of data
+    std::span<const T> suffix(index_t i) const
+    {
+        return {std::cbegin(data) + suffices[i], n - suffices[i]};
+    }
+};
+
+
+template<typename T>
+class MappedSuffixArray
+{
+    // A suffix array written by SuffixArray::save, memory mapped read only
+    // Nothing is parsed or copied, so opening is immediate however big the index, and every process mapping the file shares one copy of it in the page cache
+    // Queries are as SuffixArray's, but O(m log n) in the worst case if the file has no LCP arrays
+
+    using FileHeader = typename SuffixArray<T>::FileHeader;
+
+    MappedFile file;
+    const T* text;
+    n_t n;
+    PackedArray suffices;
+    PackedArray lcps[3]; // lcp, lcpLeft, lcpRight
+    bool hasLCP;
+
+public:
+    MappedSuffixArray(const char path[])
+        : file(path)
+    {
+        if (std::size(file) < sizeof(FileHeader))
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file too small");
+
+        const FileHeader& header(*reinterpret_cast<const FileHeader*>(std::begin(file)));
+
+        // byteOrder reads as its bytes reversed if the file was written on a host of the other byte order
+        if (header.byteOrder == 0x0807060504030201)
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file was written with a different byte order");
+
+        if (header.magic != SuffixArray<T>::magic || header.byteOrder != SuffixArray<T>::byteOrder || header.version != SuffixArray<T>::version)
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: not a SuffixArray file, or an unsupported version");
+
+        if (header.characterSize != sizeof(T))
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file has a different character type");
+
+        if (header.fileSize != std::size(file))
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file is truncated");
+
+        // Each section must be aligned for its type and lie within the file, so a corrupt header can't make queries read outside the mapping
+        const n_t size(std::size(file));
+        const auto inFile([&](n_t offset, n_t alignment, n_t bytes)
+        {
+            return offset % alignment == 0 && offset <= size && bytes <= size - offset;
+        });
+
+        if (header.width != SuffixArray<T>::indexWidth(header.n) || header.n > size / sizeof(T))
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file has an invalid text length or index width");
+
+        const n_t packedSize(PackedArray::wordCount(header.n, header.width) * sizeof(std::uint64_t));
+        bool valid(inFile(header.textOffset, alignof(T), header.n * sizeof(T)) && inFile(header.sufficesOffset, sizeof(std::uint64_t), packedSize));
+        if (header.hasLCP)
+            for (const std::uint64_t lcpOffset : header.lcpOffsets)
+                valid = valid && inFile(lcpOffset, sizeof(std::uint64_t), packedSize);
+
+        if (!valid)
+            throw std::runtime_error("MappedSuffixArray::MappedSuffixArray: file has a section outside the file or misaligned");
+
+        n = header.n;
+        hasLCP = header.hasLCP;
+        text = reinterpret_cast<const T*>(std::begin(file) + header.textOffset);
+        suffices = PackedArray(reinterpret_cast<const std::uint64_t*>(std::begin(file) + header.sufficesOffset), n, header.width);
+        if (hasLCP)
+            for (index_t i(0); i < 3; ++i)
+                lcps[i] = PackedArray(reinterpret_cast<const std::uint64_t*>(std::begin(file) + header.lcpOffsets[i]), n, header.width);
+    }
+
+    n_t size() const
+    {
+        return n;
+    }
+
+    std::span<const T> data() const
+    {
+        return {text, n};
+    }
+
+    // Position in the text of suffix i (in sorted order)
+    index_t position(index_t i) const
+    {
+        return suffices[i];
+    }
+
+    // Length of the longest common prefix of suffices i-1 and i
+    index_t longestCommonPrefix(index_t i) const
+    {
+        if (!hasLCP)
+            throw std::domain_error("MappedSuffixArray::longestCommonPrefix: file has no LCP array");
+
+        return lcps[0][i];
+    }
+
+    // The interval [begin, end) of suffices that start with P[0..m-1]
+    interval_t query(const T P[], n_t m) const
+    {
+        const PackedArray
+            * const lcpLeft(hasLCP ? &lcps[1] : nullptr),
+            * const lcpRight(hasLCP ? &lcps[2] : nullptr);
+
+        return
+        {
+            SuffixArray<T>::template bound<false>(text, n, suffices, lcpLeft, lcpRight, P, m),
+            SuffixArray<T>::template bound<true>(text, n, suffices, lcpLeft, lcpRight, P, m)
+        };
+    }
+
+    // Calls f(i) for the position i of each occurrence in the interval (in suffix order)
+    template<typename F>
+    void occurrences(interval_t interval, F&& f) const
+    {
+        for (index_t i(interval.first); i < interval.second; ++i)
+            f(suffices[i]);
+    }
+};
+
+
+template<typename T>
+class FMIndex
+{
+    /*
+        A compressed self-index (Ferragina and Manzini): it answers SuffixArray's queries without storing either the suffix array or the text.
+
+        The Burrows-Wheeler transform of the text (with a sentinel $, smaller than every character, appended) is the character before each suffix,
+        in suffix order: BWT[i] = s[SA[i] - 1] ($ for the suffix starting at 0). Its last-to-first mapping
+            LF(i) = C[c] + rank_c(BWT, i)    where c = BWT[i], and C[c] is the number of characters less than c
+        takes the row of the suffix at position j to the row of the suffix at j - 1, since prepending c keeps the suffices starting with c in order.
+        Backward search narrows the interval of suffices starting with P[k..m-1] to those starting with P[k-1..m-1] in the same way, with two ranks per character.
+
+        The BWT is stored in a wavelet matrix: the characters, coded as 1 to sigma (0 is $), are split on their top bit into two halves (zeros first, each stable),
+        then each half on the next bit, and so on, with a bit vector per level. rank_c is a rank per level, so O(log sigma), rather than a table per character.
+        Each rank reads one 64 byte block holding the number of set bits before it and the next 448 bits.
+
+        To locate an occurrence, LF is applied until a row whose suffix position is a multiple of sampleRate is reached, whose position is stored:
+        O(sampleRate log sigma) per occurrence, for n / sampleRate sampled positions packed into ceil(log2 n) bits.
+
+        The index takes n log2(sigma) bits for the BWT (about the size of the text for bytes), a bit per row for the sample marks, plus the samples,
+        compared to a full index per suffix (and the text) for SuffixArray.
+    */
+
+    using Unsigned = std::make_unsigned_t<T>;
+
+    struct alignas(64) RankBlock
+    {
+        std::uint64_t rank;     // Number of set bits before the block
+        std::uint64_t words[7];
+    };
+
+    class RankBits
+    {
+        static const n_t n_blockBits{448};
+
+        std::vector<RankBlock> blocks;
+
+    public:
+        RankBits() = default;
+
+        // f(i) gives bit i
+        template<typename F>
+        RankBits(n_t n, F&& f)
+            : blocks(n / n_blockBits + 1)
+        {
+            std::uint64_t rank(0);
+            for (index_t i_block(0); i_block < std::size(blocks); ++i_block)
+            {
+                RankBlock& block(blocks[i_block]);
+                block.rank = rank;
+                for (index_t i_word(0); i_word < 7; ++i_word)
+                {
+                    std::uint64_t word(0);
+                    for (index_t i_bit(0), i(i_block * n_blockBits + i_word * 64); i_bit < 64 && i < n; ++i_bit, ++i)
+                        word |= std::uint64_t(f(i)) << i_bit;
+
+                    block.words[i_word] = word;
+                    rank += std::popcount(word);
+                }
+            }
+        }
+
+        bool operator[](index_t i) const
+        {
+            const RankBlock& block(blocks[i / n_blockBits]);
+            const index_t i_bit(i % n_blockBits);
+            return block.words[i_bit / 64] >> i_bit % 64 & 1;
+        }
+
+        // Number of set bits before i
+        index_t rank(index_t i) const
+        {
+            const RankBlock& block(blocks[i / n_blockBits]);
+            const index_t i_bit(i % n_blockBits), i_word(i_bit / 64);
+
+            index_t ret(block.rank);
+            for (index_t i_w(0); i_w < i_word; ++i_w)
+                ret += std::popcount(block.words[i_w]);
+
+            return ret + std::popcount(block.words[i_word] & (std::uint64_t(1) << i_bit % 64) - 1);
+        }
+
+        n_t bitSize() const
+        {
+            return std::size(blocks) * sizeof(RankBlock) * CHAR_BIT;
+        }
+    };
+
+    n_t n;                          // Rows, including the sentinel's
+    n_t sampleRate;
+    std::vector<Unsigned> alphabet; // The distinct characters, in SuffixArray's (unsigned) order; character alphabet[c - 1] has code c
+    Array<RankBits> levels;         // The wavelet matrix, most significant bit first
+    Array<index_t> zeros;           // Number of zero bits on each level
+    Array<index_t> offsets;         // C[c] minus the first position of code c on the last level, so that LF is one walk down the levels
+    RankBits sampled;               // Rows whose position is sampled
+    PackedArray samples;            // Their positions, in row order
+
+
+    // Code of character c, 0 if it's not in the text
+    index_t code(const T& c) const
+    {
+        const auto it(std::lower_bound(std::cbegin(alphabet), std::cend(alphabet), Unsigned(c)));
+        return it != std::cend(alphabet) && *it == Unsigned(c) ? it - std::cbegin(alphabet) + 1 : 0;
+    }
+
+    // Follows the rows i_begin and i_end down the levels for code c; their difference is then rank_c(i_end) - rank_c(i_begin)
+    void walk(index_t c, index_t& i_begin, index_t& i_end) const
+    {
+        for (index_t level(0); level < std::size(levels); ++level)
+        {
+            const RankBits& bits(levels[level]);
+            if (c >> std::size(levels) - 1 - level & 1)
+            {
+                i_begin = zeros[level] + bits.rank(i_begin);
+                i_end = zeros[level] + bits.rank(i_end);
+            }
+            else
+            {
+                i_begin -= bits.rank(i_begin);
+                i_end -= bits.rank(i_end);
+            }
+        }
+    }
+
+    // Row of the suffix one position before row i's
+    index_t LF(index_t i) const
+    {
+        index_t c(0);
+        for (index_t level(0); level < std::size(levels); ++level)
+        {
+            const RankBits& bits(levels[level]);
+            const bool bit(bits[i]);
+            c = c << 1 | bit;
+            i = bit ? zeros[level] + bits.rank(i) : i - bits.rank(i);
+        }
+
+        return offsets[c] + i;
+    }
+
+public:
+    // sampleRate trades locate time for space
+    FMIndex(const SuffixArray<T>& sa, n_t sampleRate = 32)
+        : n(sa.n + 1), sampleRate(sampleRate)
+    {
+        static_assert(std::is_integral_v<T>, "FMIndex: characters must be integral");
+
+        if (sampleRate == 0)
+            throw std::domain_error("FMIndex::FMIndex: sampleRate must be positive");
+
+        alphabet.assign(std::cbegin(sa.data), std::cbegin(sa.data) + sa.n);
+        std::sort(std::begin(alphabet), std::end(alphabet));
+        alphabet.erase(std::unique(std::begin(alphabet), std::end(alphabet)), std::end(alphabet));
+
+        // Row 0 is the sentinel's suffix, row i + 1 is suffices[i]
+        const auto position([&](index_t i){ return i == 0 ? sa.n : sa.suffices[i - 1]; });
+
+        Array<index_t> bwt(n);
+        for (index_t i(0); i < n; ++i)
+            bwt[i] = position(i) == 0 ? 0 : code(sa.data[position(i) - 1]);
+
+        // C[c] = number of codes less than c
+        const n_t sigma(std::size(alphabet) + 1);
+        Array<index_t> C(sigma + 1);
+        for (const index_t c : bwt)
+            ++C[c + 1];
+        std::partial_sum(std::cbegin(C), std::cend(C), std::begin(C));
+
+        // Build the levels, stably partitioning the codes by each bit in turn
+        const n_t n_levels(std::max(::bitSize(sigma - 1), n_t(1)));
+        levels = Array<RankBits>(n_levels);
+        zeros = Array<index_t>(n_levels);
+
+        Array<index_t> next(n);
+        for (index_t level(0); level < n_levels; ++level)
+        {
+            const index_t shift(n_levels - 1 - level);
+            levels[level] = RankBits(n, [&](index_t i){ return bwt[i] >> shift & 1; });
+
+            index_t i_zero(0);
+            for (const index_t c : bwt)
+                i_zero += !(c >> shift & 1);
+            zeros[level] = i_zero;
+
+            index_t i_one(i_zero);
+            i_zero = 0;
+            for (const index_t c : bwt)
+                next[c >> shift & 1 ? i_one++ : i_zero++] = c;
+            std::swap(bwt, next);
+        }
+
+        offsets = Array<index_t>(index_t(1) << n_levels);
+        for (index_t i(n); i --> 0;)
+            offsets[bwt[i]] = i;
+        for (index_t c(0); c < sigma; ++c)
+            offsets[c] = C[c] - offsets[c];
+
+        sampled = RankBits(n, [&](index_t i){ return position(i) % sampleRate == 0; });
+        samples = PackedArray(sampled.rank(n), SuffixArray<T>::indexWidth(n));
+        for (index_t i(0), i_sample(0); i < n; ++i)
+            if (position(i) % sampleRate == 0)
+                samples.set(i_sample++, position(i));
+    }
+
+    FMIndex(const Array<T>& input, n_t sampleRate = 32)
+        : FMIndex(SuffixArray<T>(input), sampleRate)
+    {}
+
+    // Length of the text
+    n_t size() const
+    {
+        return n - 1;
+    }
+
+    // The interval [begin, end) of rows of suffices that start with P[0..m-1], by backward search in O(m log sigma) time
+    // Rows are numbered as SuffixArray's suffices, plus one
+    interval_t query(const T P[], n_t m) const
+    {
+        index_t i_begin(0), i_end(n);
+        for (index_t k(m); k --> 0 && i_begin < i_end;)
+        {
+            const index_t c(code(P[k]));
+            if (c == 0)
                 return {0, 0};
+
+            walk(c, i_begin, i_end);
+            i_begin += offsets[c];
+            i_end += offsets[c];
         }
 
-        return {begin + n_input - 1, end + n_input - 1};
+        return {i_begin, i_end};
+    }
+
+    n_t count(const T P[], n_t m) const
+    {
+        const interval_t interval(query(P, m));
+        return interval.second - interval.first;
+    }
+
+    // Position in the text of the suffix of row i, in O(sampleRate log sigma) time
+    index_t locate(index_t i) const
+    {
+        n_t n_steps(0);
+        for (; !sampled[i]; ++n_steps)
+            i = LF(i);
+
+        return samples[sampled.rank(i)] + n_steps;
+    }
+
+    // Calls f(i) for the position i of each occurrence in the interval (in suffix order)
+    template<typename F>
+    void occurrences(interval_t interval, F&& f) const
+    {
+        for (index_t i(interval.first); i < interval.second; ++i)
+            f(locate(i));
+    }
+
+    // Size of the index in bits
+    n_t bitSize() const
+    {
+        n_t ret(sampled.bitSize() + samples.bitSize() + (std::size(zeros) + std::size(offsets)) * bitSize_v<index_t> + std::size(alphabet) * bitSize_v<Unsigned>);
+        for (const RankBits& level : levels)
+            ret += level.bitSize();
+
+        return ret;
     }
 };
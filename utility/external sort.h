@@ -0,0 +1,270 @@
+#pragma once
+
+#include "typedefs.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+// Sequential, block buffered file I/O of trivially copyable records, and sorting of files larger than memory
+namespace external
+{
+    // Size of each reader's and writer's buffer
+    inline constexpr n_t n_blockBytes{1 << 20};
+
+    template<typename T>
+    class Reader
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "external::Reader: records must be trivially copyable");
+
+        std::ifstream file;
+        std::vector<T> buffer;
+        index_t i{};
+        n_t n_buffered{};
+
+        void fill()
+        {
+            file.read(reinterpret_cast<char*>(std::data(buffer)), std::size(buffer) * sizeof(T));
+            n_buffered = file.gcount() / sizeof(T);
+            i = 0;
+        }
+
+    public:
+        // Reads from record i_begin of the file
+        Reader(const std::filesystem::path& path, index_t i_begin = 0, n_t n_bufferBytes = n_blockBytes)
+            : file(path, std::ios::binary), buffer(std::max(n_bufferBytes / sizeof(T), n_t(1)))
+        {
+            if (!file)
+                throw std::runtime_error("external::Reader: couldn't open " + path.string());
+
+            file.seekg(i_begin * sizeof(T));
+            fill();
+        }
+
+        bool empty() const
+        {
+            return i == n_buffered;
+        }
+
+        const T& front() const
+        {
+            return buffer[i];
+        }
+
+        T pop()
+        {
+            const T ret(buffer[i]);
+            if (++i == n_buffered)
+                fill();
+
+            return ret;
+        }
+    };
+
+    template<typename T>
+    class Writer
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "external::Writer: records must be trivially copyable");
+
+        std::ofstream file;
+        std::vector<T> buffer;
+        n_t n_written{};
+
+    public:
+        Writer(const std::filesystem::path& path, n_t n_bufferBytes = n_blockBytes)
+            : file(path, std::ios::binary)
+        {
+            if (!file)
+                throw std::runtime_error("external::Writer: couldn't create " + path.string());
+
+            buffer.reserve(std::max(n_bufferBytes / sizeof(T), n_t(1)));
+        }
+
+        // Errors are only thrown by flush, so flush explicitly to find out if the file was written
+        ~Writer()
+        {
+            try
+            {
+                flush();
+            }
+            catch (...)
+            {}
+        }
+
+        void push(const T& v)
+        {
+            buffer.push_back(v);
+            if (std::size(buffer) == buffer.capacity())
+                flush();
+        }
+
+        void flush()
+        {
+            file.write(reinterpret_cast<const char*>(std::data(buffer)), std::size(buffer) * sizeof(T));
+            n_written += std::size(buffer);
+            buffer.clear();
+
+            if (!file)
+                throw std::runtime_error("external::Writer: write failed");
+        }
+
+        // Number of records pushed
+        n_t size() const
+        {
+            return n_written + std::size(buffer);
+        }
+    };
+
+    // Uniquely named files in a directory, removed when it's destroyed (or by remove)
+    // Names start with 64 random bits per object, so that processes sharing the directory don't overwrite each other's files
+    class TemporaryFiles
+    {
+        std::filesystem::path directory;
+        std::string prefix;
+        n_t n_made{};
+        std::vector<std::filesystem::path> paths;
+
+        static std::string randomPrefix()
+        {
+            std::random_device RD;
+            const std::uint64_t bits(std::uint64_t(RD()) << 32 ^ RD());
+
+            char hex[17];
+            for (index_t i(0); i < 16; ++i)
+                hex[i] = "0123456789abcdef"[bits >> 60 - 4 * i & 0xF];
+            hex[16] = 0;
+
+            return hex;
+        }
+
+    public:
+        TemporaryFiles(const std::filesystem::path& directory)
+            : directory(directory), prefix(randomPrefix())
+        {}
+
+        TemporaryFiles(const TemporaryFiles&) = delete;
+        TemporaryFiles& operator=(const TemporaryFiles&) = delete;
+
+        ~TemporaryFiles()
+        {
+            for (const std::filesystem::path& path : paths)
+            {
+                std::error_code error;
+                std::filesystem::remove(path, error);
+            }
+        }
+
+        std::filesystem::path make()
+        {
+            // Skip names that are taken anyway
+            std::filesystem::path path;
+            do
+                path = directory / ("external." + prefix + "." + std::to_string(n_made++) + ".tmp");
+            while (std::filesystem::exists(path));
+
+            paths.push_back(path);
+            return path;
+        }
+
+        void remove(const std::filesystem::path& path)
+        {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    };
+
+    /*
+        Sorts the records of the file input into the file output (which may be the same file), using about memoryBudget bytes of memory.
+
+        Runs of memoryBudget bytes are sorted in memory and written to temporary files, which are then merged, up to memoryBudget / n_blockBytes - 1 at once
+        (one block buffer each, plus the output's), in as many passes as needed. Every pass reads and writes the data sequentially.
+        Not stable.
+    */
+    template<typename T, typename Less>
+    void sort(const std::filesystem::path& input, const std::filesystem::path& output, Less&& less, n_t memoryBudget, TemporaryFiles& temporaryFiles)
+    {
+        const n_t
+            n_run(std::max(memoryBudget / sizeof(T), n_t(1))),
+            n_fanIn(std::max(memoryBudget / n_blockBytes, n_t(3)) - 1);
+
+        // Sort runs
+        std::vector<std::filesystem::path> runs;
+        {
+            Reader<T> reader(input);
+            std::vector<T> run;
+            run.reserve(n_run);
+            while (!reader.empty())
+            {
+                run.clear();
+                while (!reader.empty() && std::size(run) < n_run)
+                    run.push_back(reader.pop());
+
+                std::sort(std::begin(run), std::end(run), less);
+
+                runs.push_back(temporaryFiles.make());
+                Writer<T> writer(runs.back());
+                for (const T& v : run)
+                    writer.push(v);
+                writer.flush();
+            }
+        }
+
+        if (runs.empty())
+        {
+            Writer<T> writer(output);
+            return;
+        }
+
+        // Merge groups of n_fanIn runs until one is left, writing the last merge to output
+        while (std::size(runs) > 1 || runs.front() != output)
+        {
+            std::vector<std::filesystem::path> merged;
+            for (index_t i_begin(0); i_begin < std::size(runs); i_begin += n_fanIn)
+            {
+                const index_t i_end(std::min(i_begin + n_fanIn, std::size(runs)));
+                const std::filesystem::path path(std::size(runs) <= n_fanIn ? output : temporaryFiles.make());
+                {
+                    std::vector<Reader<T>> readers;
+                    readers.reserve(i_end - i_begin);
+                    for (index_t i(i_begin); i < i_end; ++i)
+                        readers.emplace_back(runs[i]);
+
+                    // A heap of the readers, by their next record
+                    const auto greater([&](const Reader<T>* lhs, const Reader<T>* rhs){ return less(rhs->front(), lhs->front()); });
+                    std::vector<Reader<T>*> heap;
+                    for (Reader<T>& reader : readers)
+                        if (!reader.empty())
+                            heap.push_back(&reader);
+                    std::make_heap(std::begin(heap), std::end(heap), greater);
+
+                    Writer<T> writer(path);
+                    while (!heap.empty())
+                    {
+                        std::pop_heap(std::begin(heap), std::end(heap), greater);
+                        Reader<T>* const reader(heap.back());
+                        writer.push(reader->pop());
+                        if (reader->empty())
+                            heap.pop_back();
+                        else
+                            std::push_heap(std::begin(heap), std::end(heap), greater);
+                    }
+                    writer.flush();
+                }
+
+                for (index_t i(i_begin); i < i_end; ++i)
+                    temporaryFiles.remove(runs[i]);
+
+                merged.push_back(path);
+            }
+
+            runs = std::move(merged);
+        }
+    }
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "typedefs.h"
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// A read only memory mapping of a whole file
+// The pages are shared with every other process mapping the same file, and are only read from disk as they're accessed
+class MappedFile
+{
+    const std::byte* data{};
+    n_t n{};
+
+#ifdef _WIN32
+    HANDLE
+        file{INVALID_HANDLE_VALUE},
+        mapping{};
+#endif
+
+    void unmap() noexcept
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+
+        file = INVALID_HANDLE_VALUE;
+        mapping = {};
+#else
+        if (data)
+            munmap(const_cast<std::byte*>(data), n);
+#endif
+
+        data = {};
+        n = {};
+    }
+
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const char path[])
+    {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("MappedFile::MappedFile: couldn't open " + std::string(path));
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size))
+        {
+            unmap();
+            throw std::runtime_error("MappedFile::MappedFile: couldn't get the size of " + std::string(path));
+        }
+
+        n = n_t(size.QuadPart);
+        if (!n)
+            return;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            data = static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        const int fd(open(path, O_RDONLY));
+        if (fd == -1)
+            throw std::runtime_error("MappedFile::MappedFile: couldn't open " + std::string(path));
+
+        struct stat status;
+        if (fstat(fd, &status) == -1)
+        {
+            close(fd);
+            throw std::runtime_error("MappedFile::MappedFile: couldn't get the size of " + std::string(path));
+        }
+
+        n = n_t(status.st_size);
+        if (!n)
+        {
+            close(fd);
+            return;
+        }
+
+        // The mapping stays valid after the file descriptor is closed
+        void* p(mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0));
+        close(fd);
+        if (p != MAP_FAILED)
+            data = static_cast<const std::byte*>(p);
+#endif
+
+        if (!data)
+        {
+            unmap();
+            throw std::runtime_error("MappedFile::MappedFile: couldn't map " + std::string(path));
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& rhs) noexcept
+    {
+        *this = std::move(rhs);
+    }
+
+    MappedFile& operator=(MappedFile&& rhs) noexcept
+    {
+        unmap();
+        std::swap(data, rhs.data);
+        std::swap(n, rhs.n);
+#ifdef _WIN32
+        std::swap(file, rhs.file);
+        std::swap(mapping, rhs.mapping);
+#endif
+        return *this;
+    }
+
+    ~MappedFile()
+    {
+        unmap();
+    }
+
+    const std::byte* begin() const
+    {
+        return data;
+    }
+
+    const std::byte* end() const
+    {
+        return data + n;
+    }
+
+    n_t size() const
+    {
+        return n;
+    }
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "typedefs.h"
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+
+// An array of n unsigned integers of width bits each (1 to 64), packed end to end into 64-bit words, least significant bits first
+// Either owns its words or views words owned elsewhere (e.g. a memory mapped file), in which case it's read only
+class PackedArray
+{
+    std::vector<std::uint64_t> ownedWords;
+    const std::uint64_t* words{};
+    n_t n{};
+    n_t width{1};
+
+    std::uint64_t mask() const
+    {
+        return width == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << width) - 1;
+    }
+
+public:
+    static n_t wordCount(n_t n, n_t width)
+    {
+        return (n * width + 63) / 64;
+    }
+
+    // Writes the words of the packed array of v(0), ..., v(n-1) to os, without building it in memory
+    template<typename F>
+    static void write(std::ostream& os, n_t n, n_t width, F&& v)
+    {
+        const std::uint64_t mask(width == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << width) - 1);
+
+        std::uint64_t word(0);
+        n_t n_bits(0);
+        for (index_t i(0); i < n; ++i)
+        {
+            const std::uint64_t value(v(i) & mask);
+            word |= value << n_bits;
+            if (n_bits + width >= 64)
+            {
+                os.write(reinterpret_cast<const char*>(&word), sizeof(word));
+                word = n_bits ? value >> (64 - n_bits) : 0;
+                n_bits = n_bits + width - 64;
+            }
+            else
+                n_bits += width;
+        }
+
+        if (n_bits)
+            os.write(reinterpret_cast<const char*>(&word), sizeof(word));
+    }
+
+    PackedArray() = default;
+
+    // Owned, zeroed
+    PackedArray(n_t n, n_t width)
+        : ownedWords(wordCount(n, width)), words(ownedWords.data()), n(n), width(width)
+    {
+        if (width < 1 || width > 64)
+            throw std::domain_error("PackedArray::PackedArray: width must be 1 to 64 bits");
+    }
+
+    // A view of wordCount(n, width) words
+    PackedArray(const std::uint64_t words[], n_t n, n_t width)
+        : words(words), n(n), width(width)
+    {
+        if (width < 1 || width > 64)
+            throw std::domain_error("PackedArray::PackedArray: width must be 1 to 64 bits");
+    }
+
+    PackedArray(const PackedArray& rhs)
+        : ownedWords(rhs.ownedWords), words(rhs.ownedWords.empty() ? rhs.words : ownedWords.data()), n(rhs.n), width(rhs.width)
+    {}
+
+    PackedArray& operator=(const PackedArray& rhs)
+    {
+        ownedWords = rhs.ownedWords;
+        words = rhs.ownedWords.empty() ? rhs.words : ownedWords.data();
+        n = rhs.n;
+        width = rhs.width;
+        return *this;
+    }
+
+    // Moving a vector keeps its buffer, so words stays valid
+    PackedArray(PackedArray&&) = default;
+    PackedArray& operator=(PackedArray&&) = default;
+
+    std::uint64_t operator[](index_t i) const
+    {
+        const index_t i_bit(i * width), i_word(i_bit / 64), shift(i_bit % 64);
+
+        std::uint64_t value(words[i_word] >> shift);
+        if (shift + width > 64)
+            value |= words[i_word + 1] << (64 - shift);
+
+        return value & mask();
+    }
+
+    void set(index_t i, std::uint64_t value)
+    {
+        const index_t i_bit(i * width), i_word(i_bit / 64), shift(i_bit % 64);
+
+        value &= mask();
+        ownedWords[i_word] = ownedWords[i_word] & ~(mask() << shift) | value << shift;
+        if (shift + width > 64)
+            ownedWords[i_word + 1] = ownedWords[i_word + 1] & ~(mask() >> (64 - shift)) | value >> (64 - shift);
+    }
+
+    n_t size() const
+    {
+        return n;
+    }
+
+    n_t bitWidth() const
+    {
+        return width;
+    }
+
+    const std::uint64_t* data() const
+    {
+        return words;
+    }
+
+    n_t bitSize() const
+    {
+        return wordCount(n, width) * 64;
+    }
+};
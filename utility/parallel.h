@@ -0,0 +1,203 @@
+#pragma once
+
+#include "typedefs.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace parallel
+{
+    inline n_t threadCount()
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // The requested number of threads, but at least one, as forRanges and forEach run at least one thread
+    // Per thread arrays indexed by i_thread should be sized with this
+    inline n_t threadCount(n_t n_threads)
+    {
+        return std::max(n_threads, n_t(1));
+    }
+
+    // Calls f(i_thread) on n_threads threads (including this one), rethrowing the first exception thrown by any of them
+    template<typename F>
+    void run(n_t n_threads, F&& f)
+    {
+        std::exception_ptr exception;
+        std::mutex exceptionMutex;
+
+        const auto guarded([&](index_t i_thread)
+        {
+            try
+            {
+                f(i_thread);
+            }
+            catch (...)
+            {
+                const std::lock_guard lock(exceptionMutex);
+                if (!exception)
+                    exception = std::current_exception();
+            }
+        });
+
+        std::vector<std::thread> threads;
+        for (index_t i_thread(1); i_thread < n_threads; ++i_thread)
+            threads.emplace_back(guarded, i_thread);
+
+        guarded(0);
+        for (std::thread& thread : threads)
+            thread.join();
+
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+
+    // Splits [0, n) into n_threads contiguous ranges of (nearly) equal size and calls f(i_begin, i_end, i_thread) on each in parallel
+    // For work where every index costs about the same
+    template<typename F>
+    void forRanges(n_t n, F&& f, n_t n_threads = threadCount())
+    {
+        n_threads = std::max(std::min(n_threads, n), n_t(1));
+        run(n_threads, [&](index_t i_thread)
+        {
+            f(n * i_thread / n_threads, n * (i_thread + 1) / n_threads, i_thread);
+        });
+    }
+
+    // Calls f(i) for every i in [0, n) in parallel, handing out chunks of n_chunk indices to threads as they become free
+    // For work where the cost per index varies
+    template<typename F>
+    void forEach(n_t n, F&& f, n_t n_threads = threadCount(), n_t n_chunk = 64)
+    {
+        std::atomic<index_t> i_next{};
+        n_threads = std::max(std::min(n_threads, (n + n_chunk - 1) / n_chunk), n_t(1));
+        run(n_threads, [&](index_t)
+        {
+            for (index_t i_begin; (i_begin = i_next.fetch_add(n_chunk, std::memory_order_relaxed)) < n;)
+                for (index_t i(i_begin); i < std::min(i_begin + n_chunk, n); ++i)
+                    f(i);
+        });
+    }
+
+    // Replaces data[i] with op(data[0], ..., data[i]) for an associative op
+    // Each thread scans its range, the ranges' totals are scanned, then each range but the first is combined with the total before it
+    template<typename T, typename Op>
+    void inclusiveScan(T data[], n_t n, Op&& op, n_t n_threads = threadCount())
+    {
+        if (n == 0)
+            return;
+
+        n_threads = std::max(std::min(n_threads, n), n_t(1));
+        std::vector<T> totals(n_threads);
+        forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+        {
+            for (index_t i(i_begin + 1); i < i_end; ++i)
+                data[i] = op(data[i - 1], data[i]);
+
+            totals[i_thread] = data[i_end - 1];
+        }, n_threads);
+
+        for (index_t i_thread(1); i_thread < n_threads; ++i_thread)
+            totals[i_thread] = op(totals[i_thread - 1], totals[i_thread]);
+
+        forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+        {
+            if (i_thread)
+                for (index_t i(i_begin); i < i_end; ++i)
+                    data[i] = op(totals[i_thread - 1], data[i]);
+        }, n_threads);
+    }
+
+    // Stable LSD radix sort of data[0..n-1] by the low n_keyBits bits of key(v), using buffer (of size n) as working space
+    // Each pass sorts by a byte: the threads count the bytes of their ranges, a prefix sum in (byte, thread) order gives each thread where its elements with each byte go,
+    // and the threads scatter their ranges, so elements keep their order within a byte
+    template<typename T, typename Key>
+    void radixSort(T data[], T buffer[], n_t n, n_t n_keyBits, Key&& key, n_t n_threads = threadCount())
+    {
+        const n_t
+            n_digitBits(8),
+            n_digits(n_t(1) << n_digitBits);
+
+        n_threads = std::max(std::min(n_threads, n), n_t(1));
+        std::vector<std::array<index_t, n_digits>> offsets(n_threads);
+
+        T* from(data);
+        T* to(buffer);
+        for (n_t shift(0); shift < n_keyBits; shift += n_digitBits)
+        {
+            const auto digit([&](const T& v){ return index_t(key(v) >> shift & n_digits - 1); });
+
+            forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+            {
+                std::array<index_t, n_digits>& counts(offsets[i_thread]);
+                counts.fill(0);
+                for (index_t i(i_begin); i < i_end; ++i)
+                    ++counts[digit(from[i])];
+            }, n_threads);
+
+            index_t offset(0);
+            for (index_t d(0); d < n_digits; ++d)
+                for (std::array<index_t, n_digits>& counts : offsets)
+                {
+                    const n_t count(counts[d]);
+                    counts[d] = offset;
+                    offset += count;
+                }
+
+            forRanges(n, [&](index_t i_begin, index_t i_end, index_t i_thread)
+            {
+                std::array<index_t, n_digits>& next(offsets[i_thread]);
+                for (index_t i(i_begin); i < i_end; ++i)
+                    to[next[digit(from[i])]++] = from[i];
+            }, n_threads);
+
+            std::swap(from, to);
+        }
+
+        if (from != data)
+            forRanges(n, [&](index_t i_begin, index_t i_end, index_t)
+            {
+                std::copy(from + i_begin, from + i_end, data + i_begin);
+            }, n_threads);
+    }
+
+    // Searches T[0..n_T-1] for matches of length at most n_maxMatch, splitting it into n_threads chunks that overlap by n_maxMatch - 1 characters,
+    // so every match is entirely within some chunk
+    // search(chunk, n_chunk, i_chunk, report) must call report(match) for each match in T[i_chunk..i_chunk+n_chunk-1], in order of position,
+    // with positions relative to T. position(match) is the start of a match in T
+    // A match found by two chunks (starting in the overlap) is only kept by the chunk whose own range it starts in
+    // Returns all the matches in order of position
+    template<typename Match, typename Search, typename Position>
+    std::deque<Match> search(const char T[], n_t n_T, n_t n_maxMatch, Search&& search, Position&& position, n_t n_threads = threadCount())
+    {
+        // Chunks much smaller than this aren't worth a thread
+        const n_t n_minChunk(n_t(1) << 16);
+
+        n_threads = std::max(std::min(n_threads, n_T / n_minChunk), n_t(1));
+        std::vector<std::vector<Match>> chunkMatches(n_threads);
+        forRanges(n_T, [&](index_t i_begin, index_t i_end, index_t i_thread)
+        {
+            std::vector<Match>& matches(chunkMatches[i_thread]);
+            const index_t i_chunkEnd(std::min(i_end + std::max(n_maxMatch, n_t(1)) - 1, n_T));
+            search(&T[i_begin], i_chunkEnd - i_begin, i_begin, [&](const Match& match)
+            {
+                if (position(match) < i_end)
+                    matches.push_back(match);
+            });
+        }, n_threads);
+
+        // Each chunk's matches are in order and precede the next chunk's
+        std::deque<Match> ret;
+        for (const std::vector<Match>& matches : chunkMatches)
+            ret.insert(std::end(ret), std::cbegin(matches), std::cend(matches));
+
+        return ret;
+    }
+}